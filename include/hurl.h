@@ -2,22 +2,184 @@
 
 #include <map>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <memory>
 #include <stdexcept>
+#include <exception>
+#include <functional>
+#include <future>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
 namespace hurl
 {
     typedef std::map<std::string,std::string> httpparams;
     typedef std::map<std::string,std::string> httpheaders;
 
+    // Parameters kept in the order given, in which names may repeat (e.g.
+    // id=1&id=2); see formencode
+    typedef std::vector<std::pair<std::string,std::string> > paramlist;
+    typedef std::vector<std::pair<std::string_view,std::string_view> > paramviews;
+
+    //
+    // Response headers are kept in the order they arrived, in a single
+    // buffer with a flat index over it, so parsing them costs next to no
+    // allocations. Names are stored lowercased and looked up without
+    // regard to case. Repeated headers such as Set-Cookie are all kept;
+    // where only one value is wanted, the last one wins.
+    //
+    class headerlist
+    {
+    public:
+        typedef std::pair<std::string_view, std::string_view> value_type;
+
+        class const_iterator
+        {
+        public:
+            const_iterator(headerlist const* list, size_t index)
+                : list_(list), index_(index)
+            { }
+
+            value_type operator*() const { return list_->at(index_); }
+            const_iterator& operator++() { ++index_; return *this; }
+            bool operator==(const_iterator const& o) const { return index_ == o.index_; }
+            bool operator!=(const_iterator const& o) const { return index_ != o.index_; }
+
+        private:
+            headerlist const* list_;
+            size_t index_;
+        };
+
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, fields_.size()); }
+        size_t size() const { return fields_.size(); }
+        bool empty() const { return fields_.empty(); }
+
+        // The index'th header, in arrival order
+        value_type at(size_t index) const;
+
+        // Number of headers with the given name
+        size_t count(std::string_view name) const;
+
+        // The value of the named header, or an empty view if it is absent
+        std::string_view get(std::string_view name) const;
+
+        // Every value of the named header, in arrival order
+        std::vector<std::string_view> getall(std::string_view name) const;
+
+        // As get(), but as a string, for code written against httpheaders
+        std::string operator[](std::string_view name) const;
+
+        void add(std::string_view name, std::string_view value);
+        void clear();
+
+        // Parse one raw header line as it came off the wire. A status line
+        // starts a new response (e.g. after a redirect or 100 Continue), so
+        // it clears the headers of the last one.
+        void parseline(const char* data, size_t size);
+
+        // Compatibility view: one entry per name, the last value winning
+        operator httpheaders() const;
+
+    private:
+        // Offsets into buf_ rather than views, so copies stay valid
+        struct field
+        {
+            size_t name, namelen;
+            size_t value, valuelen;
+        };
+
+        std::string buf_;
+        std::vector<field> fields_;
+    };
+
+    //
+    // Statistics describe where the time went in a request, and how much
+    // data it moved. Times are in seconds, each measured from the start of
+    // the request to the end of the given phase, so e.g. connect includes
+    // namelookup.
+    //
+    struct httpstats
+    {
+        httpstats()
+            : namelookup(0), connect(0), appconnect(0), starttransfer(0),
+              total(0), uploaded(0), downloaded(0), reused(false),
+              decompress(0), cached(false)
+        { }
+
+        double namelookup;      // DNS resolution finished
+        double connect;         // TCP connection established
+        double appconnect;      // TLS handshake finished (0 without TLS)
+        double starttransfer;   // First byte of the response arrived
+        double total;           // Transfer complete
+        long long uploaded;     // Request body bytes sent
+        long long downloaded;   // Response body bytes received, as sent
+                                // on the wire (i.e. before decompression)
+        bool reused;            // Whether an existing connection was used
+        double decompress;      // Time spent decompressing the body
+        bool cached;            // Whether the body came from a responsecache
+                                // (the times are then those of the
+                                // revalidation, or all 0 if there was none)
+    };
+
     //
     // A response describes the result of a hurl HTTP request.
     //
     struct httpresponse
     {
         int status;
-        httpheaders headers;
+        headerlist headers;
         std::string body;
+        httpstats stats;
+    };
+
+    //
+    // A body sink receives a response body in chunks as it arrives, rather
+    // than having it buffered into httpresponse::body. Each call is handed
+    // the next size bytes of the (already decompressed) body; returning
+    // false stops the transfer early without raising an error.
+    //
+    typedef std::function<bool(const char* data, size_t size)> bodysink;
+
+    //
+    // A body source supplies a request body in chunks as it is sent, so
+    // that uploads needn't be held in memory. Each call may write up to
+    // size bytes into buffer, and returns how many it wrote; returning 0
+    // ends the body. If it throws, the request stops and the exception is
+    // rethrown to the caller.
+    //
+    typedef std::function<size_t(char* buffer, size_t size)> bodysource;
+
+
+    //
+    // compressionpolicy
+    //  Decides whether and how post compresses request bodies. Bodies no
+    //  larger than threshold bytes are sent as they are; larger ones are
+    //  compressed with the given algorithm, at the given level (-1 for a
+    //  sensible default). zstd and brotli are only available if hurl was
+    //  built with HURL_WITH_ZSTD or HURL_WITH_BROTLI; asking for them
+    //  otherwise throws.
+    //
+    //  In adaptive mode, a sample of each body is compressed first. The
+    //  body is sent uncompressed if the sample hardly shrinks, or if the
+    //  upload speed measured on earlier requests is high enough that the
+    //  compressor, rather than the link, would be the bottleneck.
+    //
+    struct compressionpolicy
+    {
+        enum encoding { none, gzip, deflate, zstd, brotli };
+
+        compressionpolicy()
+            : algorithm(gzip), level(-1), threshold(10240), adaptive(false)
+        { }
+
+        encoding algorithm;
+        int level;
+        size_t threshold;
+        bool adaptive;
     };
 
 
@@ -108,12 +270,209 @@ namespace hurl
                                  std::string const&     data,
                                  int                    timeout = 0);
 
+    //
+    // get (string, bodysink)
+    // get (string, httpparams, bodysink)
+    // post (string, string, bodysink)
+    // post (string, httpparams, bodysink)
+    //  Streaming variants of the functions above. The response body is
+    //  passed to sink chunk by chunk, straight from libcurl's buffer, and
+    //  is never held in memory as a whole; gzip-encoded bodies are decoded
+    //  incrementally. The returned response carries the status and headers
+    //  but an empty body.
+    //
+    //  If sink returns false the transfer stops and the function returns
+    //  normally. If sink throws, the transfer stops and the exception is
+    //  rethrown to the caller.
+    //
+    httpresponse get            (std::string const&     url,
+                                 bodysink const&        sink,
+                                 int                    timeout = 0);
+
+    httpresponse get            (std::string const&     url,
+                                 httpparams const&      params,
+                                 bodysink const&        sink,
+                                 int                    timeout = 0);
+
+    httpresponse post           (std::string const&     url,
+                                 std::string const&     data,
+                                 bodysink const&        sink,
+                                 int                    timeout = 0);
+
+    httpresponse post           (std::string const&     url,
+                                 httpparams const&      params,
+                                 bodysink const&        sink,
+                                 int                    timeout = 0);
+
+    //
+    // get (string, httpresponse&)
+    //  As get (string), but fills in an existing response rather than
+    //  returning a new one, reusing the memory its body and headers
+    //  already hold. A loop that fetches into the same response over and
+    //  over then stops allocating once the buffers are big enough. If the
+    //  request fails, the response is left empty.
+    //
+    void get                    (std::string const&     url,
+                                 httpresponse&          into,
+                                 int                    timeout = 0);
+
+    //
+    // urlencode (string_view)
+    //  Percent-encode a string for a query string or form body: every byte
+    //  but the unreserved characters of RFC 3986 (letters, digits and
+    //  "-._~") becomes %XX. The result is the same as curl_easy_escape's.
+    //
+    std::string urlencode       (std::string_view       value);
+
+    //
+    // formencode (httpparams)
+    // formencode (paramlist)
+    // formencode (paramviews)
+    //  Serialize parameters as name=value pairs joined by '&', each name
+    //  and value urlencoded, in the container's order; this is what the
+    //  httpparams overloads above send. For parameters in a paramlist or
+    //  paramviews, pass the result to the string variants: e.g.
+    //
+    //      get(url + "?" + formencode(list));
+    //      post(url, formencode(list));
+    //
+    std::string formencode      (httpparams const&      params);
+
+    std::string formencode      (paramlist const&       params);
+
+    std::string formencode      (paramviews const&      params);
+
+    //
+    // mappedbody
+    //  A read-only response body that stays on the heap while it is small,
+    //  and moves into a memory-mapped temporary file once it outgrows a
+    //  threshold. A mapped body takes no heap: the kernel is free to page
+    //  it out to its file under memory pressure, and it can be handed to a
+    //  parser as a plain range of bytes without being copied.
+    //
+    //  Copies share the same bytes, which are released (and the file
+    //  unmapped) along with the last copy. The file is unlinked as soon as
+    //  it is created, so nothing is left behind on disk.
+    //
+    class mappedbody
+    {
+    public:
+        mappedbody();
+
+        const char* data() const;
+        size_t size() const;
+        bool empty() const;
+
+        const char* begin() const;
+        const char* end() const;
+        std::string_view view() const;
+
+        // Whether the body was spilled to a mapping
+        bool mapped() const;
+
+        // Where the bytes live; only hurl.cpp can make or look into one
+        class impl;
+
+    private:
+        std::shared_ptr<impl> impl_;
+        const char* data_;
+        size_t size_;
+    };
+
+    //
+    // A response whose body is a mappedbody; otherwise as httpresponse.
+    //
+    struct mappedresponse
+    {
+        int status;
+        headerlist headers;
+        mappedbody body;
+        httpstats stats;
+    };
+
+    //
+    // Options for getmapped.
+    //
+    struct mapoptions
+    {
+        mapoptions()
+            : threshold(8 << 20)
+        { }
+
+        size_t threshold;       // Bodies larger than this are mapped; 0
+                                // maps every non-empty body
+        std::string directory;  // Where to create the file backing the
+                                // mapping; empty for $TMPDIR, or /tmp
+    };
+
+    //
+    // getmapped (string, mapoptions)
+    //  As get (string), but the body is collected into a mappedbody. Once
+    //  it passes options.threshold, or as soon as the Content-Length says
+    //  it will, the body is written straight into the mapping rather than
+    //  into a string. The file's disk space is reserved as the mapping
+    //  grows, so a full disk fails the request with runtime_error rather
+    //  than crashing on a write. getmapped bypasses any responsecache.
+    //
+    mappedresponse getmapped    (std::string const&     url,
+                                 mapoptions const&      options = mapoptions(),
+                                 int                    timeout = 0);
+
+    //
+    // Options for streamed uploads.
+    //
+    struct uploadoptions
+    {
+        uploadoptions()
+            : length(-1), compress(false), method("POST"),
+              contenttype("application/octet-stream")
+        { }
+
+        long long length;       // Size of the body, if known in advance;
+                                // -1 sends it with chunked encoding
+        bool compress;          // gzip the body as it is sent. The result is
+                                // always chunked, whatever length says.
+        std::string method;     // POST, PUT, or any other method
+        std::string contenttype; // Content-Type header; none if empty
+    };
+
+    //
+    // upload (string, bodysource, uploadoptions)
+    // uploadfile (string, string, uploadoptions)
+    // uploadfd (string, int, uploadoptions)
+    //  Send a request whose body is streamed rather than held in memory:
+    //  from a body source, a local file, or a file descriptor (read from
+    //  its current position to EOF, and not closed). Memory use stays
+    //  bounded however big the body is, including when it is compressed.
+    //  For files and regular-file descriptors the length is found
+    //  automatically if options.length is -1.
+    //
+    httpresponse upload         (std::string const&     url,
+                                 bodysource const&      source,
+                                 uploadoptions const&   options = uploadoptions(),
+                                 int                    timeout = 0);
+
+    httpresponse uploadfile     (std::string const&     url,
+                                 std::string const&     localpath,
+                                 uploadoptions const&   options = uploadoptions(),
+                                 int                    timeout = 0);
+
+    httpresponse uploadfd       (std::string const&     url,
+                                 int                    fd,
+                                 uploadoptions const&   options = uploadoptions(),
+                                 int                    timeout = 0);
+
     //
     // download (string, string)
     //  Download a file via HTTP GET to the local filesystem. If a file with
     //  the specified path already exists and is writable, it will be
     //  truncated before the download begins, even if the server returns an
-    //  error status.
+    //  error status. The server may send the file gzip-compressed; it is
+    //  decompressed on the fly as it is written.
+    //
+    //  The body is gathered into large buffers which are written out whole,
+    //  and disk space is reserved up front from the Content-Length; see
+    //  downloadoptions for finer control.
     //
     //  url         The URL of the file to download
     //  localpath   Path in the local filesystem to save the file to
@@ -123,6 +482,92 @@ namespace hurl
                                  std::string const&     localpath,
                                  int                    timeout = 0);
 
+    //
+    // downloadoptions
+    //  Tuning for download (string, string, downloadoptions).
+    //
+    //  connections Maximum number of ranges fetched at once, each on its
+    //              own connection. Defaults to 4.
+    //  chunksize   Size, in bytes, of each range. If 0, the file is split
+    //              into exactly as many ranges as there are connections.
+    //              Defaults to 8 MB.
+    //
+    //  And for writing the file, in ranges or not:
+    //
+    //  buffersize  Bytes gathered before each write. Defaults to 1 MB.
+    //  direct      Write with O_DIRECT (F_NOCACHE on macOS), bypassing the
+    //              page cache; falls back quietly where the filesystem
+    //              doesn't support it. Defaults to false.
+    //  dropcache   Push each buffer to disk as it is written and drop it
+    //              from the page cache, so that multi-GB downloads don't
+    //              crowd out everything else. Defaults to false.
+    //  preallocate Reserve disk space for the whole file up front. Defaults
+    //              to true.
+    //
+    struct downloadoptions
+    {
+        downloadoptions()
+            : connections(4), chunksize(8 << 20), buffersize(1 << 20),
+              direct(false), dropcache(false), preallocate(true)
+        { }
+
+        int connections;
+        long long chunksize;
+        size_t buffersize;
+        bool direct;
+        bool dropcache;
+        bool preallocate;
+    };
+
+    //
+    // download (string, string, downloadoptions)
+    //  Download a large file over several connections at once. A HEAD
+    //  request first asks for the file's size and whether the server
+    //  accepts byte ranges; if it does, the file is preallocated and split
+    //  into ranges, which are fetched concurrently and written into place.
+    //  Otherwise, or if the file fits in a single range, this falls back to
+    //  a plain single-stream download. With fewer than two connections it
+    //  goes straight to one, without the HEAD request.
+    //
+    //  Ranges are always requested uncompressed. If any range fails, the
+    //  whole download fails with the corresponding exception.
+    //
+    //  The returned response carries the status and headers of the HEAD
+    //  request, or those of the single-stream download on fallback.
+    //
+    httpresponse download       (std::string const&     url,
+                                 std::string const&     localpath,
+                                 downloadoptions const& options,
+                                 int                    timeout = 0);
+
+    //
+    // resumedownload (string, string, int)
+    //  Download a file via HTTP GET, picking up where an earlier attempt
+    //  left off. Unlike download, an existing file at localpath is not
+    //  truncated: if an interrupted download left part of it behind, only
+    //  the remainder is requested (with Range and If-Range), and appended.
+    //  The ETag or Last-Modified of the file is checkpointed beside it in
+    //  localpath + ".hurl-resume" so that resuming works across processes;
+    //  if the file has changed on the server, it is downloaded afresh.
+    //
+    //  Timeouts, connection failures and transfers cut short are retried
+    //  automatically, with a growing delay between attempts.
+    //
+    //  Transfers are never compressed, error responses are never written
+    //  to the file, and a file that was already complete is reported with
+    //  status 200.
+    //
+    //  url         The URL of the file to download
+    //  localpath   Path in the local filesystem to save the file to
+    //  attempts    Maximum number of attempts before the last error is
+    //              thrown
+    //  timeout     Time, in seconds, to wait before failing each attempt
+    //
+    httpresponse resumedownload (std::string const&     url,
+                                 std::string const&     localpath,
+                                 int                    attempts = 5,
+                                 int                    timeout = 0);
+
     //
     // downloadtarball (string, string, string)
     //  Download a tar-encoded archive to the specified path and extract it
@@ -144,14 +589,477 @@ namespace hurl
                                  std::string const& extractdir,
                                  int timeout = 0);
 
+    //
+    // tarballoptions
+    //  Options for downloadtarball (string, string, string, tarballoptions).
+    //
+    //  gunzip      Accept gzip-compressed archives (.tar.gz), which are
+    //              recognized by their magic number and decompressed
+    //              inline. Defaults to true.
+    //  keeparchive Also save the archive, as received, to localpath. If
+    //              false, localpath is ignored and the archive never
+    //              touches the disk. Defaults to true.
+    //
+    struct tarballoptions
+    {
+        tarballoptions()
+            : gunzip(true), keeparchive(true)
+        { }
+
+        bool gunzip;
+        bool keeparchive;
+    };
+
+    //
+    // downloadtarball (string, string, string, tarballoptions)
+    //  Like downloadtarball above, but extracts the archive while it
+    //  downloads: tar headers are parsed straight out of the response and
+    //  entries are created on the fly, so extraction finishes at about the
+    //  same time as the transfer and the archive is never read back from
+    //  disk. Entries with absolute paths or ".." components are refused,
+    //  as are symlinks that point outside the archive's tree and entries
+    //  that would be written through a symlink the archive created.
+    //
+    //  As before, nothing is extracted unless the server responds with
+    //  200 OK.
+    //
+    httpresponse downloadtarball(std::string const&     url,
+                                 std::string const&     localpath,
+                                 std::string const&     extractdir,
+                                 tarballoptions const&  options,
+                                 int                    timeout = 0);
+
+    //
+    // setpoollimits (size_t, int)
+    //  Configure the process-wide connection pool used by the free
+    //  functions above. Each free function borrows a handle for the scheme,
+    //  host and port it is connecting to and returns it afterwards, so
+    //  back-to-back requests to the same host reuse keep-alive connections
+    //  (and skip DNS and TLS setup). The pool is thread-safe. Cookies are
+    //  never carried from one free function call to the next.
+    //
+    //  maxperhost  Maximum number of idle handles kept for each host. This
+    //              does not limit concurrency; surplus handles are closed
+    //              when returned. A value of 0 disables pooling.
+    //              Defaults to 8.
+    //  idletimeout Time, in seconds, an idle handle may stay in the pool
+    //              before it is closed. Defaults to 30.
+    //
+    void setpoollimits          (size_t                 maxperhost,
+                                 int                    idletimeout);
+
+    //
+    // setstatshook (statshook)
+    //  Install a function to be called with the statistics of every
+    //  completed request, made by any means (free functions, clients and
+    //  engines); e.g. to export latency histograms. It is called from
+    //  whichever thread finished the request, so it must be thread-safe,
+    //  and it should be quick. Exceptions it throws are discarded. Pass an
+    //  empty function to remove it.
+    //
+    //  host    The scheme, host and port the request went to, in the form
+    //          "https://example.com:443".
+    //  status  The HTTP status of the response
+    //  stats   Statistics for the request, as in httpresponse::stats
+    //
+    typedef std::function<void(std::string const&   host,
+                               int                  status,
+                               httpstats const&     stats)> statshook;
+
+    void setstatshook           (statshook const&       hook);
+
+    //
+    // setcompression (compressionpolicy)
+    //  Set how the free functions and engines compress request bodies.
+    //  The default gzips bodies over 10KB.
+    //
+    void setcompression         (compressionpolicy const& policy);
+
+    //
+    // retrypolicy
+    //  Decides when the buffered get and post functions (free and client)
+    //  try a failed request again. A request is retried if it throws one
+    //  of the errors chosen below, or answers with one of the statuses,
+    //  up to attempts tries in all. Between tries it waits
+    //  initialdelay * multiplier^n seconds, capped at maxdelay, of which
+    //  the fraction jitter is random: with the default of 1 the wait is
+    //  anywhere from 0 to the full delay, so clients that failed together
+    //  don't all come back together. If the response carries Retry-After,
+    //  the wait is at least as long as it asks; if it asks for more than
+    //  maxdelay, the response is returned as it is.
+    //
+    //  deadline bounds the whole call, retries and waits included: each
+    //  try's timeout is cut to what is left of it (to the second), and no
+    //  retry is begun that couldn't start before it. The last failure is
+    //  then thrown, or the last response returned.
+    //
+    //  A post is only retried if it never reached the server (it failed
+    //  to resolve or connect), unless posts is set; the server may have
+    //  acted on one that timed out or got a 503.
+    //
+    //  Hedging sends a second copy of a GET that hasn't answered after a
+    //  while, and takes whichever copy answers first; tail latency is then
+    //  that of the faster of two servers (or connections) rather than the
+    //  slower. The copy goes out after hedgequantile of the latencies seen
+    //  under the policy (e.g. 0.95 hedges the slowest twentieth), once 20
+    //  have been, or otherwise after hedgeafter seconds. Leave both at 0
+    //  not to hedge. Hedging needs a handle per copy, so it doesn't apply
+    //  to clients using setmultiplexing; nor does cutting tries short for
+    //  the deadline, as the engine times their requests.
+    //
+    //  Streaming, upload and download functions, engines and getall don't
+    //  retry; see resumedownload for downloads.
+    //
+    struct retrypolicy
+    {
+        enum
+        {
+            timeouts        = 1 << 0,   // hurl::timeout
+            connecterrors   = 1 << 1,   // hurl::connect_error
+            resolveerrors   = 1 << 2,   // hurl::resolve_error
+            transporterrors = 1 << 3    // curl_error for a connection that
+                                        // failed mid-request (reset, closed
+                                        // early, HTTP/2 stream errors)
+        };
+
+        retrypolicy()
+            : attempts(3), errors(timeouts | connecterrors | transporterrors),
+              statuses({ 429, 502, 503, 504 }), posts(false),
+              initialdelay(0.1), multiplier(2), maxdelay(10), jitter(1),
+              retryafter(true), deadline(0), hedgeafter(0), hedgequantile(0)
+        { }
+
+        int attempts;           // Tries in all, counting the first
+        int errors;             // Errors to retry, from the flags above
+        std::vector<int> statuses; // Statuses to retry
+        bool posts;             // Retry posts whatever the failure
+        double initialdelay;    // Wait before the first retry, in seconds
+        double multiplier;      // Growth of the wait with each retry
+        double maxdelay;        // Longest wait, in seconds
+        double jitter;          // Random fraction of each wait, 0 to 1
+        bool retryafter;        // Honour Retry-After
+        double deadline;        // Budget for the whole call, in seconds;
+                                // 0 for none
+        double hedgeafter;      // Hedge GETs after this many seconds; 0
+                                // not to (until hedgequantile takes over)
+        double hedgequantile;   // Hedge GETs after this quantile of recent
+                                // latencies; 0 not to
+    };
+
+    //
+    // setretrypolicy (retrypolicy)
+    //  Retry the free functions' requests according to the given policy.
+    //  By default nothing is retried; a policy with attempts = 1 and no
+    //  hedging goes back to that.
+    //
+    void setretrypolicy         (retrypolicy const&     policy);
+
+    //
+    // Options for a ratelimiter.
+    //
+    struct ratelimitoptions
+    {
+        ratelimitoptions()
+            : rate(0), burst(1), maxperhost(0), maxrecvspeed(0), maxsendspeed(0)
+        { }
+
+        double rate;            // Requests per second, across all hosts;
+                                // 0 for no limit
+        double burst;           // Requests that may start at once after a
+                                // lull, before rate applies
+        size_t maxperhost;      // Requests in flight to any one host; 0
+                                // for no limit
+        long long maxrecvspeed; // Bytes per second each request may
+                                // receive; 0 for no cap
+        long long maxsendspeed; // Bytes per second each request may send;
+                                // 0 for no cap
+    };
+
+    //
+    // ratestats
+    //  Counters for a ratelimiter, since it was created. waited / requests
+    //  is the mean delay the limiter added to each request.
+    //
+    struct ratestats
+    {
+        ratestats()
+            : requests(0), throttled(0), queued(0), waited(0), maxwait(0),
+              inflight(0)
+        { }
+
+        long long requests;     // Requests let through
+        long long throttled;    // Of those, how many waited for the rate
+        long long queued;       // ... and how many for a slot at their host
+        double waited;          // Total time spent waiting, in seconds
+        double maxwait;         // Longest single wait, in seconds
+        long long inflight;     // Requests under way now, on all hosts
+    };
+
+    //
+    // ratelimiter
+    //  Paces the requests made through it, for use with setratelimiter and
+    //  client::setratelimiter. A request first waits for a slot at its host
+    //  (scheme, host and port), if maxperhost are already in flight, and
+    //  then for its turn under rate, a token bucket holding burst tokens;
+    //  while it runs its transfer speed is capped at maxrecvspeed and
+    //  maxsendspeed. A request that is retried is paced again each time.
+    //  The waits count against the request's timeout (and so its retry
+    //  deadline); a request that can't get through in time throws
+    //  hurl::timeout.
+    //
+    //  Starting a request takes no lock unless it has to wait for a host
+    //  slot (beyond a shared one to find its host's counter), so a limiter
+    //  can be shared by any number of threads and clients; give each
+    //  service that needs protecting a limiter of its own.
+    //
+    //  Only blocking requests are paced. Async requests (engines, getasync,
+    //  getall and the coroutine functions) are not, as waiting would stall
+    //  the caller or the engine's thread; engineoptions::maxperhost bounds
+    //  their connections instead.
+    //
+    //  A ratelimiter must outlive its use by clients and free functions.
+    //
+    class ratelimiter
+    {
+    public:
+        explicit ratelimiter(ratelimitoptions const& options);
+        ~ratelimiter();
+
+        ratestats stats() const;
+
+        // The limiter's state; opaque outside hurl.cpp
+        class impl;
+
+    private:
+        std::unique_ptr<impl> impl_;
+
+        // Noncopyable
+        ratelimiter(ratelimiter const&);
+        ratelimiter& operator=(ratelimiter const&);
+    };
+
+    //
+    // setratelimiter (ratelimiter*)
+    //  Pace the free functions' requests with the given limiter; NULL
+    //  turns this off. Clients aren't affected; see client::setratelimiter.
+    //
+    void setratelimiter         (ratelimiter*           limiter);
+
+    //
+    // session_cache
+    //  A cache of connection state that several clients, and the free
+    //  functions, can share, so that talking to the same host from many
+    //  of them costs one DNS lookup and one full TLS handshake rather than
+    //  one each. Wraps a libcurl share object, with locking so it can be
+    //  used from any number of threads.
+    //
+    //  what is a combination of the flags below, saying what to share:
+    //
+    //  dns         Resolved host names.
+    //  tls         TLS session IDs, so new connections can resume sessions.
+    //  connections Open connections themselves. Note that libcurl does not
+    //              support using shared connections from several threads at
+    //              once; only enable this if the users of the cache take
+    //              turns.
+    //  cookies     The cookie jar. Every client (or free function call)
+    //              using the cache then sees the same cookies.
+    //
+    //  A session_cache must outlive every client that uses it, and must be
+    //  unset with setsessioncache(NULL) before it is destroyed.
+    //
+    class session_cache
+    {
+    public:
+        enum
+        {
+            dns         = 1 << 0,
+            tls         = 1 << 1,
+            connections = 1 << 2,
+            cookies     = 1 << 3
+        };
+
+        explicit session_cache(int what = dns | tls);
+        ~session_cache();
+
+        // The underlying CURLSH*
+        void* native() const;
+
+    private:
+        class impl;
+        std::unique_ptr<impl> impl_;
+
+        // Noncopyable
+        session_cache(session_cache const&);
+        session_cache& operator=(session_cache const&);
+    };
+
+    //
+    // setsessioncache (session_cache*)
+    //  Make the free functions (and engines) share the given cache; NULL
+    //  turns sharing off again.
+    //
+    void setsessioncache        (session_cache*         cache);
+
+    //
+    // bufferpool
+    //  Recycles response body buffers between requests. Hand a body back
+    //  with recycle() once finished with it, and a client that was given
+    //  the pool with setbufferpool() will collect its next response into
+    //  that buffer, with the capacity it already has. Up to maxbuffers are
+    //  kept; any more are freed. Thread-safe.
+    //
+    class bufferpool
+    {
+    public:
+        explicit bufferpool(size_t maxbuffers = 16);
+        ~bufferpool();
+
+        // A buffer from the pool, or a new empty one if there are none
+        std::string acquire();
+
+        void recycle(std::string&& buffer);
+
+    private:
+        class impl;
+        std::unique_ptr<impl> impl_;
+
+        // Noncopyable
+        bufferpool(bufferpool const&);
+        bufferpool& operator=(bufferpool const&);
+    };
+
+    //
+    // cachestats
+    //  Counters for a responsecache, since it was created. The hit rate is
+    //  (hits + revalidated) / (hits + revalidated + misses).
+    //
+    struct cachestats
+    {
+        cachestats()
+            : hits(0), revalidated(0), misses(0), stores(0), evictions(0),
+              diskhits(0), diskevictions(0), bytessaved(0), bytes(0),
+              entries(0), diskbytes(0)
+        { }
+
+        long long hits;         // Served while fresh, without a request
+        long long revalidated;  // Stale, but confirmed unchanged with a 304
+        long long misses;       // Fetched in full
+        long long stores;       // Responses added or refreshed
+        long long evictions;    // Dropped from memory to stay within budget
+        long long diskhits;     // Missing from memory, but found on disk
+        long long diskevictions; // Deleted from disk to stay within budget
+        long long bytessaved;   // Body bytes served instead of transferred
+        size_t bytes;           // Memory held by entries now
+        size_t entries;         // Entries in memory now
+        size_t diskbytes;       // Disk space used by entries now
+    };
+
+    //
+    // responsecache
+    //  An HTTP cache for GET responses, for use with setresponsecache and
+    //  client::setresponsecache. Responses are kept by URL while their
+    //  Cache-Control max-age (or Expires, or failing both a tenth of their
+    //  age according to Last-Modified) says they are fresh, and handed out
+    //  again without a request. Once stale, or if the server said
+    //  no-cache, they are revalidated with If-None-Match and
+    //  If-Modified-Since, and a 304 Not Modified is turned back into the
+    //  cached response. no-store responses, and those that Vary on
+    //  anything but Accept-Encoding, are never kept.
+    //
+    //  Up to maxbytes of entries are kept in memory, least recently used
+    //  first out. If a directory is given, every entry is also written
+    //  there, up to maxdiskbytes, so it outlives eviction from memory and
+    //  the process itself. Thread-safe.
+    //
+    //  Only the buffered get functions use the cache; streaming gets,
+    //  posts, downloads and engines always go to the server. Being private
+    //  to the application, the cache keeps responses whatever cookies they
+    //  were fetched with.
+    //
+    class responsecache
+    {
+    public:
+        explicit responsecache(size_t maxbytes = 64 << 20,
+                               std::string const& directory = "",
+                               size_t maxdiskbytes = 1 << 30);
+        ~responsecache();
+
+        cachestats stats() const;
+
+        // Forget every entry, on disk too
+        void clear();
+
+        // Entries and their bookkeeping, defined in hurl.cpp
+        class impl;
+
+    private:
+        std::unique_ptr<impl> impl_;
+
+        // Noncopyable
+        responsecache(responsecache const&);
+        responsecache& operator=(responsecache const&);
+    };
+
+    //
+    // setresponsecache (responsecache*)
+    //  Make the free get functions use the given cache; NULL turns caching
+    //  off again. The cache must outlive its use.
+    //
+    void setresponsecache       (responsecache*         cache);
+
+    //
+    // completion
+    //  Invoked when an asynchronous request (see engine, and the client's
+    //  async functions) finishes, on the thread running the requests. If
+    //  the request failed, error holds the exception and response is
+    //  undefined. Callbacks should be quick and must not block, since
+    //  every other request waits on them; exceptions they throw are
+    //  discarded.
+    //
+    typedef std::function<void(std::exception_ptr   error,
+                               httpresponse&        response)> completion;
+
+    //
+    // engineoptions
+    //  How an engine's requests use connections.
+    //
+    //  http1       HTTP/1.1 only; each request in flight has a connection
+    //              to itself.
+    //  http2       HTTP/2 where the server offers it during the TLS
+    //              handshake, so plain http:// stays on HTTP/1.1. This is
+    //              the default, as it is libcurl's.
+    //  http2prior  HTTP/2 everywhere, assuming that cleartext servers speak
+    //              it without being asked (h2c with prior knowledge).
+    //
+    //  With HTTP/2, concurrent requests to a host are multiplexed over one
+    //  connection, up to maxstreams at a time, and wait for a stream
+    //  rather than opening another connection.
+    //
+    struct engineoptions
+    {
+        enum protocol { http1, http2, http2prior };
+
+        engineoptions()
+            : version(http2), maxstreams(100), maxperhost(0), maxtotal(0)
+        { }
+
+        protocol version;
+        long maxstreams;        // Concurrent streams per HTTP/2 connection
+        long maxperhost;        // Connections per host; 0 for no limit
+        long maxtotal;          // Connections in all; 0 for no limit
+    };
+
     //
     // client
     //  A convenience class representing a client session, used to perform
-    //  multiple requests to a service with a given base URL. Uses a single
-    //  cURL handle, which has two important consequences:
+    //  multiple requests to a service with a given base URL. This has two
+    //  important consequences:
     //
     //  1. Cookies are saved between requests.
-    //  2. Requests made on the same client are NOT THREAD-SAFE.
+    //  2. Requests may be made on the same client from many threads at
+    //     once. Each request in flight borrows its own cURL handle from the
+    //     client's pool (creating one if need be), and all of them share a
+    //     single cookie jar, so the session stays consistent.
     //
     //  The parameters for client's member functions are the same as those
     //  for the corresponding free functions above, except that the first
@@ -186,6 +1094,73 @@ namespace hurl
         //
         std::string base        () const;
 
+        //
+        // setsessioncache (session_cache*)
+        //  Share DNS, TLS session and/or connection caches with others
+        //  using the given session_cache; NULL goes back to the client's
+        //  private cache. The current cookies are carried over, but from
+        //  then on the client's requests only share cookies with each other
+        //  if the cache was created with session_cache::cookies. Best
+        //  called before any requests are made.
+        //
+        void setsessioncache    (session_cache*         cache);
+
+        //
+        // setbufferpool (bufferpool*)
+        //  Take the bodies of buffered responses from the given pool; NULL
+        //  turns this off. The pool must outlive its use by the client.
+        //
+        void setbufferpool      (bufferpool*            pool);
+
+        //
+        // setresponsecache (responsecache*)
+        //  Serve the client's buffered and async gets from the given cache;
+        //  NULL turns this off. The cache may be shared with other clients,
+        //  and must outlive its use by this one.
+        //
+        void setresponsecache   (responsecache*         cache);
+
+        //
+        // setcompression (compressionpolicy)
+        //  Compress this client's request bodies according to the given
+        //  policy, rather than the global one. An adaptive policy learns
+        //  the speed of the links this client uses.
+        //
+        void setcompression     (compressionpolicy const& policy);
+
+        //
+        // setretrypolicy (retrypolicy)
+        //  Retry this client's buffered requests according to the given
+        //  policy, rather than the global one. Hedged requests learn the
+        //  latencies of this client's requests only.
+        //
+        void setretrypolicy     (retrypolicy const&     policy);
+
+        //
+        // setratelimiter (ratelimiter*)
+        //  Pace this client's blocking requests with the given limiter;
+        //  NULL turns this off. The limiter may be shared with other
+        //  clients, and must outlive its use by this one. Requests through
+        //  setmultiplexing's engine aren't paced.
+        //
+        void setratelimiter     (ratelimiter*           limiter);
+
+        //
+        // setmultiplexing (engineoptions)
+        //  Run the client's requests through a private engine with the
+        //  given options, so that with engineoptions::http2 or http2prior
+        //  concurrent requests share connections as HTTP/2 streams. This
+        //  applies to the async functions below, and to the buffered get
+        //  and post functions (the blocking calls wait on the engine, and
+        //  get into a response doesn't reuse its buffers); the streaming
+        //  and download functions still use a handle each.
+        //  Waits for any requests in flight on the old engine to finish.
+        //
+        //  Since the buffered functions then wait on the engine's thread,
+        //  they must not be called from a completion callback.
+        //
+        void setmultiplexing    (engineoptions const&   options);
+
         //
         // cookie ()
         //  Retrieve all currently stored cookie data as a sequence of
@@ -206,26 +1181,342 @@ namespace hurl
         httpresponse get        (std::string const&     path,
                                  httpparams const&      params);
 
+        void get                (std::string const&     path,
+                                 httpresponse&          into);
+
+        //
+        // getasync, postasync
+        //  Submit a request without waiting for it, as with engine, and
+        //  either return a future or invoke a completion callback. The
+        //  requests share the client's cookies and compression policy, and
+        //  use the engine set up by setmultiplexing (or one with default
+        //  options, created on first use). A GET answered by the client's
+        //  response cache is still completed on the engine's thread.
+        //
+        std::future<httpresponse> getasync(std::string const& path);
+
+        std::future<httpresponse> getasync(std::string const& path,
+                                 httpparams const&      params);
+
+        std::future<httpresponse> postasync(std::string const& path,
+                                 std::string const&     data);
+
+        std::future<httpresponse> postasync(std::string const& path,
+                                 httpparams const&      params);
+
+        void getasync           (std::string const&     path,
+                                 completion const&      done);
+
+        void postasync          (std::string const&     path,
+                                 std::string const&     data,
+                                 completion const&      done);
+
         httpresponse post       (std::string const&     path,
                                  std::string const&     data);
 
         httpresponse post       (std::string const&     path,
                                  httpparams const&      params);
 
+        httpresponse get        (std::string const&     path,
+                                 bodysink const&        sink);
+
+        httpresponse get        (std::string const&     path,
+                                 httpparams const&      params,
+                                 bodysink const&        sink);
+
+        httpresponse post       (std::string const&     path,
+                                 std::string const&     data,
+                                 bodysink const&        sink);
+
+        httpresponse post       (std::string const&     path,
+                                 httpparams const&      params,
+                                 bodysink const&        sink);
+
+        mappedresponse getmapped(std::string const&     path,
+                                 mapoptions const&      options = mapoptions());
+
+        httpresponse upload     (std::string const&     path,
+                                 bodysource const&      source,
+                                 uploadoptions const&   options = uploadoptions());
+
+        httpresponse uploadfile (std::string const&     path,
+                                 std::string const&     localpath,
+                                 uploadoptions const&   options = uploadoptions());
+
+        httpresponse uploadfd   (std::string const&     path,
+                                 int                    fd,
+                                 uploadoptions const&   options = uploadoptions());
+
         httpresponse download   (std::string const&     path,
                                  std::string const&     localpath);
 
+        httpresponse resumedownload(std::string const&  path,
+                                 std::string const&     localpath,
+                                 int                    attempts = 5);
+
         httpresponse downloadtarball(std::string const& path,
                                  std::string const&     localpath,
                                  std::string const&     extractdir);
 
+        httpresponse downloadtarball(std::string const& path,
+                                 std::string const&     localpath,
+                                 std::string const&     extractdir,
+                                 tarballoptions const&  options);
+
     private:
         class impl;
-        std::auto_ptr<impl> impl_;
+        std::unique_ptr<impl> impl_;
 
         // Noncopyable
         client(client const&);
         client& operator=(client const&);
     };
-}
 
+    //
+    // engine
+    //  Runs many requests concurrently from a single background thread,
+    //  using one libcurl multi handle, driven through curl's socket
+    //  interface with epoll where available, so that thousands of requests
+    //  in flight cost little more than a few. Requests are submitted from
+    //  any thread and either return a std::future or invoke a completion
+    //  callback. Failures are reported with the same exceptions as the
+    //  blocking functions (hurl::timeout, hurl::connect_error, ...), either
+    //  rethrown by future::get() or passed to the callback.
+    //
+    //  Handles are borrowed from the same connection pool as the free
+    //  functions, so connections are reused across requests. Options set
+    //  the HTTP version and connection limits; see engineoptions.
+    //
+    //  E.g.,
+    //
+    //      engine e;
+    //      std::future<httpresponse> a = e.get("http://example.com/a");
+    //      std::future<httpresponse> b = e.get("http://example.com/b");
+    //      std::cout << a.get().body << b.get().body;
+    //
+    //  Destroying an engine blocks until every request it was given has
+    //  completed.
+    //
+    class engine
+    {
+    public:
+        // Invoked on the engine's thread; see hurl::completion
+        typedef hurl::completion completion;
+
+        explicit engine(engineoptions const& options = engineoptions());
+        ~engine();
+
+        std::future<httpresponse> get(std::string const&    url,
+                                      int                   timeout = 0);
+
+        std::future<httpresponse> get(std::string const&    url,
+                                      httpparams const&     params,
+                                      int                   timeout = 0);
+
+        std::future<httpresponse> post(std::string const&   url,
+                                       std::string const&   data,
+                                       int                  timeout = 0);
+
+        std::future<httpresponse> post(std::string const&   url,
+                                       httpparams const&    params,
+                                       int                  timeout = 0);
+
+        std::future<httpresponse> download(std::string const&   url,
+                                           std::string const&   localpath,
+                                           int                  timeout = 0);
+
+        void get                (std::string const&     url,
+                                 completion const&      done,
+                                 int                    timeout = 0);
+
+        void get                (std::string const&     url,
+                                 httpparams const&      params,
+                                 completion const&      done,
+                                 int                    timeout = 0);
+
+        void post               (std::string const&     url,
+                                 std::string const&     data,
+                                 completion const&      done,
+                                 int                    timeout = 0);
+
+        void post               (std::string const&     url,
+                                 httpparams const&      params,
+                                 completion const&      done,
+                                 int                    timeout = 0);
+
+        void download           (std::string const&     url,
+                                 std::string const&     localpath,
+                                 completion const&      done,
+                                 int                    timeout = 0);
+
+    private:
+        class impl;
+        std::unique_ptr<impl> impl_;
+
+        // Noncopyable
+        engine(engine const&);
+        engine& operator=(engine const&);
+    };
+
+    //
+    // request
+    //  One request in a batch (see getall). The method is "GET" or "POST";
+    //  data is the body of a POST.
+    //
+    struct request
+    {
+        request()
+            : method("GET"), timeout(0)
+        { }
+
+        request(std::string const& url, int timeout = 0)
+            : method("GET"), url(url), timeout(timeout)
+        { }
+
+        request(std::string const& url, std::string const& data, int timeout = 0)
+            : method("POST"), url(url), data(data), timeout(timeout)
+        { }
+
+        std::string method;
+        std::string url;
+        std::string data;
+        int timeout;
+    };
+
+    //
+    // batchresult
+    //  The outcome of one request in a batch: either a response, or the
+    //  exception the request failed with.
+    //
+    struct batchresult
+    {
+        httpresponse response;
+        std::exception_ptr error;
+
+        bool ok() const { return !error; }
+
+        // The response, or rethrows the request's exception
+        httpresponse& get();
+    };
+
+    //
+    // batchcallback
+    //  Invoked on the engine's thread as each request in a batch finishes,
+    //  in completion order, with the request's index in the batch. The
+    //  same rules apply as for hurl::completion.
+    //
+    typedef std::function<void(size_t               index,
+                               batchresult const&   result)> batchcallback;
+
+    //
+    // batchoptions
+    //  At most concurrency requests are in flight at once, over at most
+    //  connections.maxperhost connections to each host.
+    //
+    struct batchoptions
+    {
+        batchoptions()
+            : concurrency(16)
+        {
+            connections.maxperhost = 6;
+        }
+
+        size_t concurrency;
+        engineoptions connections;
+        batchcallback each;     // Optional; see batchcallback
+    };
+
+    //
+    // getall (requests, [options])
+    //  Performs every request in the batch, concurrently, and returns the
+    //  results in the same order as the requests. A request that fails has
+    //  its exception stored in its result rather than thrown, so the rest
+    //  of the batch carries on. The requests run on a private engine, and
+    //  so share its connections and a handle for each request in flight.
+    //
+    std::vector<batchresult> getall(std::vector<request> const& requests,
+                                    batchoptions const& options = batchoptions());
+
+#if defined(__cpp_impl_coroutine)
+    //
+    // Coroutines (C++20)
+    //  co_await one of the async_ functions below to make a request from a
+    //  coroutine without blocking its thread: the coroutine is suspended
+    //  while the request runs on a shared engine, and resumed with the
+    //  response, or with the exception the request failed with, when it
+    //  completes. One engine thread keeps any number of requests in flight
+    //  this way. Nothing is sent until the awaitable is awaited.
+    //
+    //  E.g., in a coroutine of whatever task type the program uses,
+    //
+    //      httpresponse r = co_await hurl::async_get("http://example.com/");
+    //
+    //  Coroutines are resumed through the awaitable's executor (see via),
+    //  or the one given to setexecutor, or failing both on the engine's
+    //  thread, where they must not block (see hurl::completion). A request
+    //  that completes before the coroutine has suspended, e.g. because it
+    //  could not be started, just carries on on the awaiting thread.
+    //
+    //  Only available when both hurl and the program are built as C++20
+    //  (make STD=c++20).
+    //
+
+    //
+    // executor
+    //  Runs the given function soon, on a thread of its choosing: a pool,
+    //  an event loop, a strand... Must not run it before returning.
+    //
+    typedef std::function<void(std::function<void()> const& work)> executor;
+
+    //
+    // setexecutor (executor)
+    //  Resume coroutines through the given executor by default; an empty
+    //  function goes back to resuming them on the engine's thread.
+    //
+    void setexecutor            (executor const&        e);
+
+    class awaitable
+    {
+    public:
+        // Starts a request, to be completed through the given callback
+        typedef std::function<void(completion const& done)> starter;
+
+        //
+        // Any completion-based call can be awaited, e.g.
+        //
+        //      co_await awaitable(std::bind(&engine::get, &e, url, _1, 0));
+        //
+        explicit awaitable(starter const& start);
+
+        // Resume through this executor rather than the default one
+        awaitable& via(executor const& e);
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> waiting);
+        httpresponse await_resume();
+
+    private:
+        struct state;
+        std::shared_ptr<state> state_;
+    };
+
+    awaitable async_get         (std::string const&     url,
+                                 int                    timeout = 0);
+
+    awaitable async_get         (std::string const&     url,
+                                 httpparams const&      params,
+                                 int                    timeout = 0);
+
+    awaitable async_post        (std::string const&     url,
+                                 std::string const&     data,
+                                 int                    timeout = 0);
+
+    awaitable async_post        (std::string const&     url,
+                                 httpparams const&      params,
+                                 int                    timeout = 0);
+
+    awaitable async_download    (std::string const&     url,
+                                 std::string const&     localpath,
+                                 int                    timeout = 0);
+#endif
+}
@@ -0,0 +1,1263 @@
+//
+// bench
+//  Benchmarks for hurl, run against an embedded HTTP server on a loopback
+//  port so that numbers are comparable from one release to the next.
+//
+//  usage: bench [seconds] [filter]
+//
+//  seconds  How long to run each request benchmark for (default 1)
+//  filter   Only run benchmarks whose name contains this string
+//
+//  Built as C++20 (make bench20), it also times the coroutine interface.
+//
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "hurl.h"
+#include <curl/curl.h>
+
+extern "C"
+{
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+}
+
+namespace hurl {
+    namespace detail {
+        std::string gzip(std::string const&);
+        std::string gunzip(std::string const&);
+        std::string encode(const char*, size_t, int, int);
+        std::string decode(std::string const&, std::string const&);
+        std::string serialize(httpparams const&);
+        extern "C" size_t headerfunc(void*, size_t, size_t, httpresponse*);
+    }
+}
+
+namespace
+{
+    typedef std::chrono::steady_clock steady;
+
+    double since(steady::time_point start)
+    {
+        return std::chrono::duration<double>(steady::now() - start).count();
+    }
+
+    // Text-like content, so compression ratios are realistic
+    std::string payload(size_t size)
+    {
+        static const char* words[] = {
+            "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+            "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"
+        };
+        std::string result;
+        result.reserve(size + 16);
+        unsigned seed = 12345;
+        while (result.size() < size)
+        {
+            seed = seed * 1103515245 + 12345;
+            result += words[(seed >> 16) % 12];
+            result += (seed & 0x100) ? "\n" : " ";
+        }
+        result.resize(size);
+        return result;
+    }
+
+    //
+    // server
+    //  A minimal HTTP/1.1 server on 127.0.0.1, one thread per connection
+    //  (which lasts as long as the connection does), with keep-alive.
+    //  Routes:
+    //
+    //    GET  /fixed/<n>       n bytes, with Content-Length
+    //    GET  /chunked/<n>     n bytes, chunked transfer encoding
+    //    GET  /gzip/<n>        n bytes, gzip-encoded if the client accepts it
+    //    GET  /slow/<ms>/<n>   n bytes, after a delay of ms milliseconds
+    //    GET  /fresh/<n>       n bytes, cacheable for an hour
+    //    GET  /etag/<n>        n bytes, with an ETag and no-cache, so that
+    //                          each request is revalidated (304 on match)
+    //    POST <anything>       reads the body and replies with its size
+    //
+    //  and whatever has been published at a path, verbatim. Clients that
+    //  open with the HTTP/2 preface (h2c with prior knowledge) get a bare
+    //  bones HTTP/2 server instead, which answers every request with 1K.
+    //
+    class server
+    {
+    public:
+        server()
+            : listener_(socket(AF_INET, SOCK_STREAM, 0)), stopping_(false), active_(0)
+        {
+            int on = 1;
+            setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = 0;
+            socklen_t len = sizeof(addr);
+            if (bind(listener_, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+                listen(listener_, 1024) != 0 ||
+                getsockname(listener_, (sockaddr*)&addr, &len) != 0)
+            {
+                throw std::runtime_error("could not start server");
+            }
+            port_ = ntohs(addr.sin_port);
+            acceptor_ = std::thread(&server::accept_loop, this);
+        }
+
+        ~server()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+                for (size_t i = 0; i < connections_.size(); ++i)
+                    shutdown(connections_[i], SHUT_RDWR);
+            }
+            shutdown(listener_, SHUT_RDWR);
+            close(listener_);
+            acceptor_.join();
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (active_ > 0)
+                idle_.wait(lock);
+        }
+
+        std::string url(std::string const& path) const
+        {
+            std::ostringstream ss;
+            ss << "http://127.0.0.1:" << port_ << path;
+            return ss.str();
+        }
+
+        // Serve data as the body of GETs for path
+        void publish(std::string const& path, std::string const& data)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            published_[path] = data;
+        }
+
+    private:
+        void accept_loop()
+        {
+            for (;;)
+            {
+                int fd = accept(listener_, NULL, NULL);
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (fd < 0 || stopping_)
+                {
+                    if (fd >= 0)
+                        close(fd);
+                    if (stopping_)
+                        return;
+                    continue;
+                }
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                connections_.push_back(fd);
+                ++active_;
+                std::thread(&server::serve, this, fd).detach();
+            }
+        }
+
+        static bool send_all(int fd, const char* data, size_t size)
+        {
+            while (size > 0)
+            {
+                ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+                if (n <= 0)
+                    return false;
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        // Reads until buf holds at least want bytes
+        static bool fill(int fd, std::string& buf, size_t want)
+        {
+            char chunk[65536];
+            while (buf.size() < want)
+            {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0)
+                    return false;
+                buf.append(chunk, n);
+            }
+            return true;
+        }
+
+        static bool read_line(int fd, std::string& buf, std::string& line)
+        {
+            size_t eol;
+            while ((eol = buf.find("\r\n")) == std::string::npos)
+            {
+                if (!fill(fd, buf, buf.size() + 1))
+                    return false;
+            }
+            line = buf.substr(0, eol);
+            buf.erase(0, eol + 2);
+            return true;
+        }
+
+        std::string const& body(std::string const& kind, size_t size)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::string& cached = cache_[kind][size];
+            if (cached.empty() && size > 0)
+                cached = (kind == "gzip") ? hurl::detail::gzip(payload(size)) : payload(size);
+            return cached;
+        }
+
+        // Runs a connection's thread, and cleans up after it
+        void serve(int fd)
+        {
+            try
+            {
+                converse(fd);
+            }
+            catch (std::exception& e)
+            {
+                std::cerr << "server: " << e.what() << "\n";
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            close(fd);
+            connections_.erase(std::find(connections_.begin(), connections_.end(), fd));
+            if (--active_ == 0)
+                idle_.notify_all();
+        }
+
+        // Answers requests on a connection until the client hangs up
+        void converse(int fd)
+        {
+            std::string buf, line;
+            for (;;)
+            {
+                // Request line and headers
+                if (!read_line(fd, buf, line))
+                    break;
+                if (line == "PRI * HTTP/2.0")
+                    return converse_h2(fd, buf);
+                std::istringstream request(line);
+                std::string method, path;
+                request >> method >> path;
+
+                std::map<std::string, std::string> headers;
+                while (read_line(fd, buf, line) && !line.empty())
+                {
+                    size_t colon = line.find(':');
+                    if (colon == std::string::npos)
+                        continue;
+                    std::string name = line.substr(0, colon);
+                    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                    size_t start = line.find_first_not_of(' ', colon + 1);
+                    headers[name] = start == std::string::npos ? "" : line.substr(start);
+                }
+
+                // Request body, if any
+                size_t received = 0;
+                if (headers["transfer-encoding"] == "chunked")
+                {
+                    for (;;)
+                    {
+                        if (!read_line(fd, buf, line))
+                            return;
+                        size_t size = strtoul(line.c_str(), NULL, 16);
+                        if (!fill(fd, buf, size + 2))
+                            return;
+                        buf.erase(0, size + 2);
+                        received += size;
+                        if (size == 0)
+                            break;
+                    }
+                }
+                else if (headers.count("content-length"))
+                {
+                    size_t size = strtoul(headers["content-length"].c_str(), NULL, 10);
+                    if (!fill(fd, buf, size))
+                        return;
+                    buf.erase(0, size);
+                    received = size;
+                }
+
+                if (!respond(fd, method, path, headers, received))
+                    break;
+            }
+        }
+
+        //
+        // HTTP/2, just enough for curl's GETs. Request headers aren't
+        // decoded (they're HPACK-compressed), so every stream gets the same
+        // 1K body; responses wait in order for flow control to allow them.
+        //
+        enum { H2_DATA = 0, H2_HEADERS = 1, H2_SETTINGS = 4, H2_PING = 6,
+               H2_GOAWAY = 7, H2_WINDOW_UPDATE = 8 };
+
+        static bool send_frame(int fd, int type, int flags, uint32_t stream,
+                               const char* payload, size_t size)
+        {
+            unsigned char head[9] = {
+                (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size,
+                (unsigned char)type, (unsigned char)flags,
+                (unsigned char)(stream >> 24), (unsigned char)(stream >> 16),
+                (unsigned char)(stream >> 8), (unsigned char)stream
+            };
+            return send_all(fd, (const char*)head, sizeof(head)) &&
+                   send_all(fd, payload, size);
+        }
+
+        static uint32_t be32(const char* p)
+        {
+            const unsigned char* u = (const unsigned char*)p;
+            return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | u[3];
+        }
+
+        void converse_h2(int fd, std::string& buf)
+        {
+            // The rest of the preface, after the request line read already
+            if (!fill(fd, buf, 8) || buf.compare(0, 8, "\r\nSM\r\n\r\n") != 0)
+                return;
+            buf.erase(0, 8);
+            if (!send_frame(fd, H2_SETTINGS, 0, 0, NULL, 0))
+                return;
+
+            std::string const& data = body("plain", 1024);
+
+            // :status 200 from the static table, and content-length as a
+            // literal with an indexed name
+            std::string headers = "\x88\x0f\x0d";
+            std::string length = std::to_string(data.size());
+            headers += char(length.size());
+            headers += length;
+
+            long long window = 65535, initial = 65535;
+            std::map<uint32_t, long long> credit;   // Stream window updates
+            std::deque<uint32_t> pending;
+            for (;;)
+            {
+                while (!pending.empty() && window >= (long long)data.size() &&
+                       initial + credit[pending.front()] >= (long long)data.size())
+                {
+                    uint32_t stream = pending.front();
+                    pending.pop_front();
+                    credit.erase(stream);
+                    window -= data.size();
+                    if (!send_frame(fd, H2_HEADERS, 0x4, stream, headers.data(), headers.size()) ||
+                        !send_frame(fd, H2_DATA, 0x1, stream, data.data(), data.size()))
+                        return;
+                }
+
+                if (!fill(fd, buf, 9))
+                    return;
+                size_t size = (size_t((unsigned char)buf[0]) << 16) |
+                              (size_t((unsigned char)buf[1]) << 8) | (unsigned char)buf[2];
+                int type = (unsigned char)buf[3];
+                int flags = (unsigned char)buf[4];
+                uint32_t stream = be32(buf.data() + 5) & 0x7fffffff;
+                if (!fill(fd, buf, 9 + size))
+                    return;
+                std::string payload = buf.substr(9, size);
+                buf.erase(0, 9 + size);
+
+                if (type == H2_HEADERS)
+                    pending.push_back(stream);
+                else if (type == H2_SETTINGS && !(flags & 0x1))
+                {
+                    for (size_t i = 0; i + 6 <= payload.size(); i += 6)
+                    {
+                        // SETTINGS_INITIAL_WINDOW_SIZE
+                        if (payload[i] == 0 && payload[i + 1] == 4)
+                            initial = be32(payload.data() + i + 2);
+                    }
+                    if (!send_frame(fd, H2_SETTINGS, 0x1, 0, NULL, 0))
+                        return;
+                }
+                else if (type == H2_WINDOW_UPDATE && payload.size() == 4)
+                {
+                    long long increment = be32(payload.data()) & 0x7fffffff;
+                    if (stream == 0)
+                        window += increment;
+                    else
+                        credit[stream] += increment;
+                }
+                else if (type == H2_PING && !(flags & 0x1))
+                {
+                    if (!send_frame(fd, H2_PING, 0x1, 0, payload.data(), payload.size()))
+                        return;
+                }
+                else if (type == H2_GOAWAY)
+                    return;
+            }
+        }
+
+        bool respond(int fd, std::string const& method, std::string const& path,
+                     std::map<std::string, std::string>& headers, size_t received)
+        {
+            std::ostringstream head;
+            head << "HTTP/1.1 200 OK\r\n";
+
+            if (method == "POST")
+            {
+                std::ostringstream reply;
+                reply << "received " << received << "\n";
+                head << "Content-Length: " << reply.str().size() << "\r\n\r\n" << reply.str();
+                return send_all(fd, head.str().data(), head.str().size());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::map<std::string, std::string>::const_iterator it = published_.find(path);
+                if (it != published_.end())
+                {
+                    head << "Content-Length: " << it->second.size() << "\r\n\r\n" << it->second;
+                    return send_all(fd, head.str().data(), head.str().size());
+                }
+            }
+
+            std::vector<std::string> parts;
+            std::istringstream ss(path);
+            std::string part;
+            while (std::getline(ss, part, '/'))
+            {
+                if (!part.empty())
+                    parts.push_back(part);
+            }
+            std::string kind = parts.empty() ? "fixed" : parts[0];
+            size_t size = parts.size() > 1 ? strtoul(parts.back().c_str(), NULL, 10) : 0;
+
+            if (kind == "slow" && parts.size() > 1)
+                std::this_thread::sleep_for(std::chrono::milliseconds(atoi(parts[1].c_str())));
+
+            if (kind == "chunked")
+            {
+                head << "Transfer-Encoding: chunked\r\n\r\n";
+                if (!send_all(fd, head.str().data(), head.str().size()))
+                    return false;
+                std::string const& data = body("plain", size);
+                for (size_t pos = 0; pos < data.size(); pos += 16384)
+                {
+                    size_t n = std::min<size_t>(16384, data.size() - pos);
+                    char prefix[32];
+                    int len = snprintf(prefix, sizeof(prefix), "%zx\r\n", n);
+                    if (!send_all(fd, prefix, len) ||
+                        !send_all(fd, data.data() + pos, n) ||
+                        !send_all(fd, "\r\n", 2))
+                        return false;
+                }
+                return send_all(fd, "0\r\n\r\n", 5);
+            }
+
+            if (kind == "fresh")
+                head << "Cache-Control: max-age=3600\r\n";
+            if (kind == "etag")
+            {
+                std::string etag = "\"" + std::to_string(size) + "\"";
+                head << "Cache-Control: no-cache\r\nETag: " << etag << "\r\n";
+                if (headers["if-none-match"] == etag)
+                {
+                    std::string reply = "HTTP/1.1 304 Not Modified\r\n"
+                                        "Cache-Control: no-cache\r\nETag: " + etag + "\r\n\r\n";
+                    return send_all(fd, reply.data(), reply.size());
+                }
+            }
+
+            bool compress = (kind == "gzip") &&
+                            headers["accept-encoding"].find("gzip") != std::string::npos;
+            std::string const& data = body(compress ? "gzip" : "plain", size);
+            if (compress)
+                head << "Content-Encoding: gzip\r\n";
+            head << "Content-Length: " << data.size() << "\r\n\r\n";
+            return send_all(fd, head.str().data(), head.str().size()) &&
+                   send_all(fd, data.data(), data.size());
+        }
+
+        int listener_;
+        int port_;
+        bool stopping_;
+        std::thread acceptor_;
+        std::mutex mutex_;
+        std::condition_variable idle_;
+        std::vector<int> connections_;
+        size_t active_;
+        std::map<std::string, std::map<size_t, std::string> > cache_;
+        std::map<std::string, std::string> published_;
+    };
+
+    //
+    // Tarballs
+    //  Just enough of ustar to build test archives: a header block per
+    //  entry, the data padded to a block, and two zero blocks at the end.
+    //
+    std::string tar_entry(std::string const& name, char type, std::string const& data,
+                          std::string const& link = "")
+    {
+        char block[512];
+        memset(block, 0, sizeof(block));
+        strncpy(block, name.c_str(), 100);
+        snprintf(block + 100, 8, "%07o", 0644);
+        snprintf(block + 108, 8, "%07o", 0);
+        snprintf(block + 116, 8, "%07o", 0);
+        snprintf(block + 124, 12, "%011zo", data.size());
+        snprintf(block + 136, 12, "%011o", 0);
+        block[156] = type;
+        strncpy(block + 157, link.c_str(), 100);
+        memcpy(block + 257, "ustar\0" "00", 8);
+
+        // The checksum is computed with its own field as spaces
+        memset(block + 148, ' ', 8);
+        unsigned sum = 0;
+        for (size_t i = 0; i < sizeof(block); ++i)
+            sum += (unsigned char)block[i];
+        snprintf(block + 148, 8, "%06o", sum);
+
+        std::string result(block, sizeof(block));
+        result += data;
+        result.append((512 - data.size() % 512) % 512, '\0');
+        return result;
+    }
+
+    std::string tar_end()
+    {
+        return std::string(1024, '\0');
+    }
+
+    //
+    // Request benchmarks
+    //  Each runs concurrency threads issuing requests back to back for the
+    //  given duration. The function under test returns the number of body
+    //  bytes it moved. A request that throws stops its thread, and the
+    //  first such error is rethrown once all the threads are done.
+    //
+    struct results
+    {
+        size_t requests;
+        size_t bytes;
+        double seconds;
+        std::vector<double> latencies;
+    };
+
+    results run(int concurrency, double duration, std::function<size_t()> const& request)
+    {
+        std::vector<std::vector<double> > latencies(concurrency);
+        std::vector<size_t> bytes(concurrency, 0);
+        std::vector<std::exception_ptr> errors(concurrency);
+        std::vector<std::thread> threads;
+
+        steady::time_point start = steady::now();
+        steady::time_point deadline = start + std::chrono::duration_cast<steady::duration>(
+                                                 std::chrono::duration<double>(duration));
+        for (int i = 0; i < concurrency; ++i)
+        {
+            threads.push_back(std::thread([&, i]() {
+                try
+                {
+                    while (steady::now() < deadline)
+                    {
+                        steady::time_point t = steady::now();
+                        bytes[i] += request();
+                        latencies[i].push_back(since(t));
+                    }
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            }));
+        }
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        for (int i = 0; i < concurrency; ++i)
+        {
+            if (errors[i])
+                std::rethrow_exception(errors[i]);
+        }
+
+        results r;
+        r.seconds = since(start);
+        r.bytes = 0;
+        for (int i = 0; i < concurrency; ++i)
+        {
+            r.bytes += bytes[i];
+            r.latencies.insert(r.latencies.end(), latencies[i].begin(), latencies[i].end());
+        }
+        r.requests = r.latencies.size();
+        std::sort(r.latencies.begin(), r.latencies.end());
+        return r;
+    }
+
+#if defined(__cpp_impl_coroutine)
+    //
+    // Coroutine benchmarks (C++20 builds only)
+    //  Each of concurrency coroutines co_awaits GETs back to back until the
+    //  deadline. They are resumed through an executor that queues them for
+    //  the benchmark's thread, as an event loop would, so every coroutine
+    //  runs on that one thread while the requests run on the engine's.
+    //
+    struct task
+    {
+        struct promise_type
+        {
+            task get_return_object() { return task(); }
+            std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+            std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+            void return_void() { }
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    class resumer
+    {
+    public:
+        resumer()
+            : running_(0)
+        { }
+
+        hurl::executor executor()
+        {
+            return std::bind(&resumer::post, this, std::placeholders::_1);
+        }
+
+        // Runs resumptions until every coroutine started has finished
+        void drain()
+        {
+            while (running_ > 0)
+            {
+                std::function<void()> work;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    while (queue_.empty())
+                        ready_.wait(lock);
+                    work = queue_.front();
+                    queue_.pop_front();
+                }
+                work();
+            }
+        }
+
+        int running_;   // Only touched on the draining thread
+
+    private:
+        void post(std::function<void()> const& work)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queue_.push_back(work);
+            }
+            ready_.notify_one();
+        }
+
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::deque<std::function<void()> > queue_;
+    };
+
+    task fetch_until(std::string url, steady::time_point deadline, resumer& r,
+                     results& out, std::exception_ptr& error)
+    {
+        try
+        {
+            while (steady::now() < deadline)
+            {
+                steady::time_point t = steady::now();
+                hurl::httpresponse resp = co_await hurl::async_get(url).via(r.executor());
+                out.bytes += resp.body.size();
+                out.latencies.push_back(since(t));
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        --r.running_;
+    }
+
+    results run_coroutines(int concurrency, double duration, std::string const& url)
+    {
+        resumer r;
+        results out;
+        out.bytes = 0;
+        std::exception_ptr error;
+
+        steady::time_point start = steady::now();
+        steady::time_point deadline = start + std::chrono::duration_cast<steady::duration>(
+                                                 std::chrono::duration<double>(duration));
+        r.running_ = concurrency;
+        for (int i = 0; i < concurrency; ++i)
+            fetch_until(url, deadline, r, out, error);
+        r.drain();
+
+        if (error)
+            std::rethrow_exception(error);
+        out.seconds = since(start);
+        out.requests = out.latencies.size();
+        std::sort(out.latencies.begin(), out.latencies.end());
+        return out;
+    }
+
+    // A failed request must resume its coroutine with the exception
+    task expect_connect_error(resumer& r, bool& raised)
+    {
+        try
+        {
+            co_await hurl::async_get("http://127.0.0.1:1/").via(r.executor());
+        }
+        catch (hurl::connect_error&)
+        {
+            raised = true;
+        }
+        --r.running_;
+    }
+#endif
+
+    double percentile(std::vector<double> const& sorted, double p)
+    {
+        if (sorted.empty())
+            return 0;
+        return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+    }
+
+    std::string human(size_t size)
+    {
+        std::ostringstream ss;
+        if (size >= (1 << 20))
+            ss << size / (1 << 20) << "M";
+        else if (size >= 1024)
+            ss << size / 1024 << "K";
+        else
+            ss << size;
+        return ss.str();
+    }
+
+    void report_header()
+    {
+        std::cout << std::left << std::setw(24) << "benchmark"
+                  << std::right << std::setw(7) << "size"
+                  << std::setw(6) << "conc"
+                  << std::setw(11) << "req/s"
+                  << std::setw(10) << "p50 ms"
+                  << std::setw(10) << "p99 ms"
+                  << std::setw(11) << "MB/s" << "\n";
+    }
+
+    void report(std::string const& name, size_t size, int concurrency, results const& r)
+    {
+        std::cout << std::left << std::setw(24) << name
+                  << std::right << std::setw(7) << human(size)
+                  << std::setw(6) << concurrency
+                  << std::fixed << std::setprecision(0)
+                  << std::setw(11) << r.requests / r.seconds
+                  << std::setprecision(3)
+                  << std::setw(10) << percentile(r.latencies, 0.50) * 1000
+                  << std::setw(10) << percentile(r.latencies, 0.99) * 1000
+                  << std::setprecision(1)
+                  << std::setw(11) << r.bytes / r.seconds / (1 << 20) << "\n";
+    }
+
+    // The serializer as it was, with a stream and curl_easy_escape, as a
+    // baseline for detail::serialize
+    std::string escape_serialize(hurl::httpparams const& params)
+    {
+        std::stringstream ss;
+        for (hurl::httpparams::const_iterator it = params.begin(); it != params.end(); ++it)
+        {
+            if (it != params.begin())
+                ss << "&";
+            char* name = curl_easy_escape(NULL, it->first.c_str(), it->first.size());
+            char* value = curl_easy_escape(NULL, it->second.c_str(), it->second.size());
+            ss << name << "=" << value;
+            curl_free(name);
+            curl_free(value);
+        }
+        return ss.str();
+    }
+
+    //
+    // Micro-benchmarks
+    //  Run the function repeatedly for about a fifth of a second and report
+    //  the time per call, and throughput if it processes bytes.
+    //
+    void micro(std::string const& name, size_t bytes, std::function<void()> const& f)
+    {
+        size_t iterations = 0;
+        steady::time_point start = steady::now();
+        double elapsed;
+        do
+        {
+            f();
+            ++iterations;
+        } while ((elapsed = since(start)) < 0.2);
+
+        std::cout << std::left << std::setw(24) << name
+                  << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(12) << elapsed / iterations * 1e9 << " ns/op";
+        if (bytes > 0)
+            std::cout << std::setprecision(1) << std::setw(10)
+                      << bytes * iterations / elapsed / (1 << 20) << " MB/s";
+        std::cout << "\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace hurl;
+
+    double duration = (argc > 1) ? atof(argv[1]) : 1.0;
+    std::string filter = (argc > 2) ? argv[2] : "";
+    struct
+    {
+        std::string filter;
+        bool operator()(std::string const& name) const
+        {
+            return name.find(filter) != std::string::npos;
+        }
+    } wanted = { filter };
+
+    try
+    {
+        server srv;
+        std::string tmpfile = "/tmp/hurl-bench-download";
+
+        report_header();
+
+        size_t sizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+        int levels[] = { 1, 8, 32 };
+
+        for (size_t s = 0; s < 3; ++s)
+        {
+            for (size_t c = 0; c < 3; ++c)
+            {
+                std::string url = srv.url("/fixed/") + std::to_string(sizes[s]);
+                if (wanted("get"))
+                    report("get", sizes[s], levels[c], run(levels[c], duration, [&]() {
+                        return get(url).body.size();
+                    }));
+            }
+        }
+
+        for (size_t c = 0; c < 3; ++c)
+        {
+            if (wanted("get chunked"))
+            {
+                std::string url = srv.url("/chunked/1048576");
+                report("get chunked", 1 << 20, levels[c], run(levels[c], duration, [&]() {
+                    return get(url).body.size();
+                }));
+            }
+            if (wanted("get gzip"))
+            {
+                std::string url = srv.url("/gzip/1048576");
+                report("get gzip", 1 << 20, levels[c], run(levels[c], duration, [&]() {
+                    return get(url).body.size();
+                }));
+            }
+            if (wanted("get slow"))
+            {
+                std::string url = srv.url("/slow/20/1024");
+                report("get slow 20ms", 1024, levels[c], run(levels[c], duration, [&]() {
+                    return get(url).body.size();
+                }));
+            }
+        }
+
+        for (size_t s = 0; s < 3; ++s)
+        {
+            for (size_t c = 0; c < 3; ++c)
+            {
+                if (!wanted("post"))
+                    continue;
+                std::string url = srv.url("/post");
+                std::string data = payload(sizes[s]);
+                report("post", sizes[s], levels[c], run(levels[c], duration, [&]() {
+                    post(url, data);
+                    return data.size();
+                }));
+            }
+        }
+
+        // The old write path, an ofstream written from every curl callback,
+        // as a baseline; then buffered pwrites, and the same with O_DIRECT
+        // and with the page cache dropped behind the writer. One stream
+        // each, so only the write path differs
+        for (size_t c = 0; c < 3; ++c)
+        {
+            if (!wanted("download ofstream"))
+                continue;
+            std::string url = srv.url("/fixed/16777216");
+            size_t counter = 0;
+            std::mutex lock;
+            report("download ofstream", 16 << 20, levels[c], run(levels[c], duration, [&]() {
+                std::string path;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    path = tmpfile + std::to_string(counter++ % levels[c]);
+                }
+                std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+                get(url, [&](const char* data, size_t size) {
+                    return bool(out.write(data, size));
+                });
+                out.close();
+                return (size_t)(16 << 20);
+            }));
+        }
+        downloadoptions buffered, direct, dropcache;
+        buffered.connections = direct.connections = dropcache.connections = 1;
+        direct.direct = true;
+        dropcache.dropcache = true;
+        struct
+        {
+            const char* name;
+            downloadoptions const& options;
+        } modes[] = {
+            { "download", buffered },
+            { "download direct", direct },
+            { "download dropcache", dropcache },
+        };
+        for (size_t m = 0; m < 3; ++m)
+        {
+            for (size_t c = 0; c < 3; ++c)
+            {
+                if (!wanted(modes[m].name))
+                    continue;
+                std::string url = srv.url("/fixed/16777216");
+                size_t counter = 0;
+                std::mutex lock;
+                report(modes[m].name, 16 << 20, levels[c], run(levels[c], duration, [&]() {
+                    std::string path;
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        path = tmpfile + std::to_string(counter++ % levels[c]);
+                    }
+                    download(url, path, modes[m].options);
+                    return (size_t)(16 << 20);
+                }));
+            }
+        }
+        for (int c = 0; c < 32; ++c)
+            unlink((tmpfile + std::to_string(c)).c_str());
+
+        // A large body collected into a string, and spilled to a mapping
+        for (size_t c = 0; c < 3; ++c)
+        {
+            std::string url = srv.url("/fixed/16777216");
+            if (wanted("get large"))
+                report("get large", 16 << 20, levels[c], run(levels[c], duration, [&]() {
+                    return get(url).body.size();
+                }));
+            if (wanted("get mapped"))
+                report("get mapped", 16 << 20, levels[c], run(levels[c], duration, [&]() {
+                    return getmapped(url).body.size();
+                }));
+        }
+
+        for (size_t s = 0; s < 3; ++s)
+        {
+            for (size_t c = 0; c < 3; ++c)
+            {
+                if (!wanted("client"))
+                    continue;
+                client shared(srv.url(""));
+                std::string path = "/fixed/" + std::to_string(sizes[s]);
+                report("client get", sizes[s], levels[c], run(levels[c], duration, [&]() {
+                    return shared.get(path).body.size();
+                }));
+            }
+        }
+
+#if defined(__cpp_impl_coroutine)
+        for (size_t s = 0; s < 3; ++s)
+        {
+            for (size_t c = 0; c < 3; ++c)
+            {
+                if (!wanted("coroutine get"))
+                    continue;
+                std::string url = srv.url("/fixed/") + std::to_string(sizes[s]);
+                report("coroutine get", sizes[s], levels[c] * 8,
+                       run_coroutines(levels[c] * 8, duration, url));
+            }
+        }
+        if (wanted("coroutine error"))
+        {
+            resumer r;
+            bool raised = false;
+            r.running_ = 1;
+            expect_connect_error(r, raised);
+            r.drain();
+            if (!raised)
+                throw std::runtime_error("coroutine error: no connect_error");
+            std::cout << std::left << std::setw(24) << "coroutine error" << "raised\n";
+        }
+#endif
+
+        // A client's GETs multiplexed through its engine, as HTTP/1.1 over
+        // a connection per request in flight, and as h2c streams sharing one
+        // connection
+        for (size_t c = 0; c < 3; ++c)
+        {
+            engineoptions::protocol versions[] = { engineoptions::http1, engineoptions::http2prior };
+            const char* names[] = { "client engine http1", "client engine h2c" };
+            for (size_t v = 0; v < 2; ++v)
+            {
+                if (!wanted(names[v]))
+                    continue;
+                client shared(srv.url(""));
+                engineoptions options;
+                options.version = versions[v];
+                shared.setmultiplexing(options);
+                try
+                {
+                    report(names[v], 1024, levels[c], run(levels[c], duration, [&]() {
+                        return shared.get("/fixed/1024").body.size();
+                    }));
+                }
+                catch (std::exception& e)
+                {
+                    // e.g. libcurl 7.88 fails streams queued for an h2c
+                    // connection with "Error in the HTTP2 framing layer"
+                    std::cout << std::left << std::setw(24) << names[v]
+                              << "failed: " << e.what() << "\n";
+                }
+            }
+        }
+
+        for (size_t s = 0; s < 3; ++s)
+        {
+            for (size_t c = 0; c < 3; ++c)
+            {
+                if (!wanted("client get into"))
+                    continue;
+                client shared(srv.url(""));
+                std::string path = "/fixed/" + std::to_string(sizes[s]);
+                report("client get into", sizes[s], levels[c], run(levels[c], duration, [&]() {
+                    thread_local httpresponse resp;
+                    shared.get(path, resp);
+                    return resp.body.size();
+                }));
+            }
+        }
+
+        // The same GETs through a response cache: served fresh from memory,
+        // and revalidated with a 304 on every request
+        for (size_t s = 0; s < 3; ++s)
+        {
+            for (size_t c = 0; c < 3; ++c)
+            {
+                if (!wanted("get cached"))
+                    continue;
+                responsecache cache;
+                setresponsecache(&cache);
+                std::string fresh = srv.url("/fresh/" + std::to_string(sizes[s]));
+                report("get cached fresh", sizes[s], levels[c], run(levels[c], duration, [&]() {
+                    return get(fresh).body.size();
+                }));
+                std::string etag = srv.url("/etag/" + std::to_string(sizes[s]));
+                report("get cached 304", sizes[s], levels[c], run(levels[c], duration, [&]() {
+                    return get(etag).body.size();
+                }));
+                setresponsecache(NULL);
+            }
+        }
+
+        // A batch of 100 slow requests, fetched one by one and with getall
+        // at increasing concurrency. req/s counts requests, but latencies
+        // are of whole batches.
+        if (wanted("getall"))
+        {
+            std::vector<request> batch(100, request(srv.url("/slow/20/1024")));
+            results serial = run(1, duration, [&]() {
+                size_t bytes = 0;
+                for (size_t i = 0; i < batch.size(); ++i)
+                    bytes += get(batch[i].url).body.size();
+                return bytes;
+            });
+            serial.requests *= batch.size();
+            report("getall serial loop", 1024, 1, serial);
+
+            for (size_t c = 0; c < 3; ++c)
+            {
+                batchoptions options;
+                options.concurrency = levels[c];
+                options.connections.maxperhost = levels[c];
+                results r = run(1, duration, [&]() {
+                    std::vector<batchresult> all = getall(batch, options);
+                    size_t bytes = 0;
+                    for (size_t i = 0; i < all.size(); ++i)
+                        bytes += all[i].get().body.size();
+                    return bytes;
+                });
+                r.requests *= batch.size();
+                report("getall slow 20ms", 1024, levels[c], r);
+            }
+        }
+
+        // Streaming extraction of 64 files of 64K
+        if (wanted("tarball"))
+        {
+            std::string archive;
+            for (int i = 0; i < 64; ++i)
+                archive += tar_entry("files/" + std::to_string(i), '0', payload(64 * 1024));
+            srv.publish("/tarball/files", archive + tar_end());
+
+            tarballoptions options;
+            options.keeparchive = false;
+            std::string extractdir = tmpfile + "-tarball";
+            report("tarball stream", archive.size(), 1, run(1, duration, [&]() {
+                downloadtarball(srv.url("/tarball/files"), "", extractdir, options);
+                return archive.size();
+            }));
+            for (int i = 0; i < 64; ++i)
+                unlink((extractdir + "/files/" + std::to_string(i)).c_str());
+            rmdir((extractdir + "/files").c_str());
+            rmdir(extractdir.c_str());
+        }
+
+        // Not a benchmark: a symlink in an archive must not let a later
+        // entry write outside extractdir
+        if (wanted("tarball escape"))
+        {
+            std::string outside = tmpfile + "-outside";
+            std::string extractdir = tmpfile + "-escape";
+            mkdir(outside.c_str(), 0755);
+            srv.publish("/tarball/escape",
+                        tar_entry("link", '2', "", outside) +
+                        tar_entry("link/x", '0', "escaped") + tar_end());
+
+            tarballoptions options;
+            options.keeparchive = false;
+            bool refused = false;
+            try
+            {
+                downloadtarball(srv.url("/tarball/escape"), "", extractdir, options);
+            }
+            catch (std::exception&)
+            {
+                refused = true;
+            }
+            bool escaped = (access((outside + "/x").c_str(), F_OK) == 0);
+            unlink((outside + "/x").c_str());
+            unlink((extractdir + "/link").c_str());
+            rmdir(outside.c_str());
+            rmdir(extractdir.c_str());
+            if (!refused || escaped)
+                throw std::runtime_error("tarball escape: archive wrote outside extractdir");
+            std::cout << std::left << std::setw(24) << "tarball escape" << "refused\n";
+        }
+
+        std::cout << "\n";
+
+        std::string text = payload(1 << 20);
+        std::string zipped = detail::gzip(text);
+        if (wanted("gzip"))
+            micro("gzip 1M", text.size(), [&]() { detail::gzip(text); });
+        if (wanted("gunzip"))
+            micro("gunzip 1M", text.size(), [&]() { detail::gunzip(zipped); });
+
+        // Content decoders, as used on response bodies. Throughput is of
+        // decompressed bytes.
+        struct
+        {
+            compressionpolicy::encoding encoding;
+            const char* name;
+        } codecs[] = {
+            { compressionpolicy::gzip, "gzip" },
+#ifdef HURL_WITH_ZSTD
+            { compressionpolicy::zstd, "zstd" },
+#endif
+#ifdef HURL_WITH_BROTLI
+            { compressionpolicy::brotli, "br" },
+#endif
+        };
+        for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); ++i)
+        {
+            std::string name = std::string("decode ") + codecs[i].name + " 1M";
+            if (!wanted(name))
+                continue;
+            std::string encoded = detail::encode(text.data(), text.size(), codecs[i].encoding, -1);
+            micro(name, text.size(), [&]() { detail::decode(encoded, codecs[i].name); });
+        }
+
+        // Query strings and forms, against the old stream-and-escape code
+        int counts[] = { 20, 300 };
+        for (size_t c = 0; c < 2; ++c)
+        {
+            if (!wanted("serialize"))
+                continue;
+            httpparams params;
+            paramlist list;
+            for (int i = 0; i < counts[c]; ++i)
+            {
+                std::string name = "param" + std::to_string(i);
+                std::string value = "some value & more/" + std::to_string(i);
+                params[name] = value;
+                list.push_back(std::make_pair(name, value));
+            }
+            std::string count = std::to_string(counts[c]);
+            size_t bytes = detail::serialize(params).size();
+            micro("serialize " + count + " escape", bytes, [&]() { escape_serialize(params); });
+            micro("serialize " + count + " params", bytes, [&]() { detail::serialize(params); });
+            micro("serialize " + count + " list", bytes, [&]() { formencode(list); });
+        }
+        if (wanted("urlencode"))
+        {
+            std::string plain = payload(64 << 10);
+            std::replace(plain.begin(), plain.end(), ' ', '-');
+            micro("urlencode 64K plain", plain.size(), [&]() { urlencode(plain); });
+            micro("urlencode 64K text", text.size() / 16, [&]() {
+                urlencode(std::string_view(text.data(), text.size() / 16));
+            });
+        }
+
+        if (wanted("headerfunc"))
+        {
+            static const char* lines[] = {
+                "HTTP/1.1 200 OK\r\n",
+                "Date: Mon, 27 Jul 2009 12:28:53 GMT\r\n",
+                "Server: Apache/2.2.14 (Win32)\r\n",
+                "Last-Modified: Wed, 22 Jul 2009 19:15:56 GMT\r\n",
+                "Content-Length: 88\r\n",
+                "Content-Type: application/json; charset=utf-8\r\n",
+                "Cache-Control: private, max-age=0, must-revalidate\r\n",
+                "ETag: \"737060cd8c284d8af7ad3082f209582d\"\r\n",
+                "Set-Cookie: session=abcdef0123456789; Path=/; HttpOnly\r\n",
+                "Set-Cookie: theme=dark; Path=/\r\n",
+                "Vary: Accept-Encoding\r\n",
+                "X-Request-Id: 4b2f6c1e-8f3a-4d2b-9c7e-1a2b3c4d5e6f\r\n",
+                "\r\n"
+            };
+            micro("headerfunc 13 lines", 0, [&]() {
+                httpresponse resp;
+                for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i)
+                    detail::headerfunc((void*)lines[i], 1, strlen(lines[i]), &resp);
+            });
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -9,15 +9,52 @@
 #include <exception>
 #include <stdexcept>
 #include <vector>
+#include <deque>
+#include <list>
+#include <set>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <cmath>
 
 extern "C"
 {
 #include <zlib.h>
 #include <curl/curl.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/time.h>
 #include <libtar.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#define HURL_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 }
 
+#ifdef HURL_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HURL_WITH_BROTLI
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+#endif
+
 namespace hurl
 {
     timeout::timeout()
@@ -42,6 +79,230 @@ namespace hurl
     }
 
 
+    namespace detail
+    {
+        // ASCII only, unlike std::tolower: header names are tokens, and
+        // matching them must not depend on the locale
+        inline char lower(char c)
+        {
+            return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+
+        inline bool iequals(std::string_view a, std::string_view b)
+        {
+            if (a.size() != b.size())
+                return false;
+            for (size_t i = 0; i < a.size(); ++i)
+            {
+                if (lower(a[i]) != lower(b[i]))
+                    return false;
+            }
+            return true;
+        }
+
+        inline bool is_space(char c)
+        {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        }
+    }
+
+    headerlist::value_type headerlist::at(size_t index) const
+    {
+        field const& f = fields_[index];
+        return value_type(std::string_view(buf_.data() + f.name, f.namelen),
+                          std::string_view(buf_.data() + f.value, f.valuelen));
+    }
+
+    size_t headerlist::count(std::string_view name) const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < fields_.size(); ++i)
+        {
+            if (detail::iequals(at(i).first, name))
+                ++n;
+        }
+        return n;
+    }
+
+    std::string_view headerlist::get(std::string_view name) const
+    {
+        for (size_t i = fields_.size(); i-- > 0; )
+        {
+            value_type header = at(i);
+            if (detail::iequals(header.first, name))
+                return header.second;
+        }
+        return std::string_view();
+    }
+
+    std::vector<std::string_view> headerlist::getall(std::string_view name) const
+    {
+        std::vector<std::string_view> result;
+        for (size_t i = 0; i < fields_.size(); ++i)
+        {
+            value_type header = at(i);
+            if (detail::iequals(header.first, name))
+                result.push_back(header.second);
+        }
+        return result;
+    }
+
+    std::string headerlist::operator[](std::string_view name) const
+    {
+        return std::string(get(name));
+    }
+
+    void headerlist::add(std::string_view name, std::string_view value)
+    {
+        // Enough for the headers of most responses in one allocation each
+        if (fields_.empty())
+        {
+            buf_.reserve(1024);
+            fields_.reserve(16);
+        }
+
+        field f;
+        f.name = buf_.size();
+        f.namelen = name.size();
+        for (size_t i = 0; i < name.size(); ++i)
+            buf_ += detail::lower(name[i]);
+        f.value = buf_.size();
+        f.valuelen = value.size();
+        buf_.append(value.data(), value.size());
+        fields_.push_back(f);
+    }
+
+    void headerlist::clear()
+    {
+        buf_.clear();
+        fields_.clear();
+    }
+
+    void headerlist::parseline(const char* data, size_t size)
+    {
+        std::string_view line(data, size);
+        while (!line.empty() && detail::is_space(line.back()))
+            line.remove_suffix(1);
+
+        if (line.compare(0, 5, "HTTP/") == 0)
+        {
+            clear();
+            return;
+        }
+
+        // Obsolete line folding continues the previous header's value,
+        // which is always at the end of the buffer, so extend it in place
+        if (!line.empty() && (line[0] == ' ' || line[0] == '\t'))
+        {
+            while (!line.empty() && detail::is_space(line.front()))
+                line.remove_prefix(1);
+            if (!fields_.empty())
+            {
+                buf_ += ' ';
+                buf_.append(line.data(), line.size());
+                fields_.back().valuelen += line.size() + 1;
+            }
+            return;
+        }
+
+        // Per RFC 2616, each header line consists of a token followed
+        // by a ':' and then a value, preceded by any amount of leading
+        // whitespace.
+        size_t cpos = line.find(':');
+        if (cpos == std::string_view::npos)
+            return;
+        std::string_view value = line.substr(cpos + 1);
+        while (!value.empty() && detail::is_space(value.front()))
+            value.remove_prefix(1);
+        add(line.substr(0, cpos), value);
+    }
+
+    headerlist::operator httpheaders() const
+    {
+        httpheaders result;
+        for (size_t i = 0; i < fields_.size(); ++i)
+        {
+            value_type header = at(i);
+            result[std::string(header.first)] = std::string(header.second);
+        }
+        return result;
+    }
+
+
+    //
+    // mappedbody class implementation. The impl owns the bytes: either a
+    // string, or a mapping it unmaps when the last copy goes.
+    //
+    class mappedbody::impl
+    {
+    public:
+        impl()
+            : map(NULL), length(0)
+        { }
+
+        ~impl()
+        {
+            if (map)
+                munmap(map, length);
+        }
+
+        // A body over size bytes at data, which storage keeps alive
+        static mappedbody make(std::shared_ptr<impl> const& storage,
+                               const char* data, size_t size)
+        {
+            mappedbody body;
+            body.impl_ = storage;
+            body.data_ = data;
+            body.size_ = size;
+            return body;
+        }
+
+        std::string heap;
+        void* map;
+        size_t length;          // Of the mapping, which may exceed the body
+    };
+
+    mappedbody::mappedbody()
+        : data_(""), size_(0)
+    {
+    }
+
+    const char* mappedbody::data() const
+    {
+        return data_;
+    }
+
+    size_t mappedbody::size() const
+    {
+        return size_;
+    }
+
+    bool mappedbody::empty() const
+    {
+        return size_ == 0;
+    }
+
+    const char* mappedbody::begin() const
+    {
+        return data_;
+    }
+
+    const char* mappedbody::end() const
+    {
+        return data_ + size_;
+    }
+
+    std::string_view mappedbody::view() const
+    {
+        return std::string_view(data_, size_);
+    }
+
+    bool mappedbody::mapped() const
+    {
+        return impl_ && impl_->map;
+    }
+
+
     namespace detail
     {
         // Ensure that curl_global_init gets called at program startup,
@@ -58,12 +319,30 @@ namespace hurl
             }
         } moo;
 
+        // Translate a CURLcode into the matching hurl exception
+        void check(int code)
+        {
+            if (CURLE_OK == code)
+                return;
+            if (CURLE_OPERATION_TIMEDOUT == code)
+                throw timeout();
+            if (CURLE_COULDNT_RESOLVE_HOST == code)
+                throw resolve_error();
+            if (CURLE_COULDNT_CONNECT == code)
+                throw connect_error();
+            else
+                throw curl_error(code);
+        }
+
         class handle
         {
         public:
             handle()
                 : handle_(curl_easy_init()),
-                  headers_(NULL)
+                  headers_(NULL),
+                  share_(NULL),
+                  recvspeed_(0),
+                  sendspeed_(0)
             {
                 if (handle_ == NULL)
                     throw std::runtime_error("curl_easy_init failed");
@@ -86,21 +365,36 @@ namespace hurl
                 headers_ = NULL;
             }
 
-            void perform()
+            // Hand the stored headers and speed caps to curl; perform() does
+            // this itself, but handles driven by a multi handle must call it
+            // first
+            void apply()
             {
-                // Set stored headers, then perform
                 setopt(CURLOPT_HTTPHEADER, headers_);
-                int code = curl_easy_perform(handle_);
-                if (CURLE_OK == code)
-                    return;
-                if (CURLE_OPERATION_TIMEDOUT == code)
-                    throw timeout();
-                if (CURLE_COULDNT_RESOLVE_HOST == code)
-                    throw resolve_error();
-                if (CURLE_COULDNT_CONNECT == code)
-                    throw connect_error();
-                else
-                    throw curl_error(code);
+                if (recvspeed_ > 0)
+                    setopt(CURLOPT_MAX_RECV_SPEED_LARGE, recvspeed_);
+                if (sendspeed_ > 0)
+                    setopt(CURLOPT_MAX_SEND_SPEED_LARGE, sendspeed_);
+            }
+
+            // Cap the speed of this handle's transfers, in bytes per second
+            // (0 for no cap). Unlike other options, this outlasts reset().
+            void throttle(curl_off_t recv, curl_off_t send)
+            {
+                recvspeed_ = recv;
+                sendspeed_ = send;
+            }
+
+            // Cap this handle's speed as another's is
+            void throttle(handle const& like)
+            {
+                throttle(like.recvspeed_, like.sendspeed_);
+            }
+
+            void perform()
+            {
+                apply();
+                check(curl_easy_perform(handle_));
             }
 
             void reset()
@@ -125,6 +419,16 @@ namespace hurl
                     throw curl_error(code);
             }
 
+            // Attach to a share object, or detach with NULL. curl_easy_reset
+            // leaves the share alone, so this only talks to curl on change.
+            void share(CURLSH* sh)
+            {
+                if (sh == share_)
+                    return;
+                setopt(CURLOPT_SHARE, sh);
+                share_ = sh;
+            }
+
             CURL* get() const
             {
                 return handle_;
@@ -133,447 +437,6093 @@ namespace hurl
         private:
             CURL* handle_;
             curl_slist* headers_;
+            CURLSH* share_;
+            curl_off_t recvspeed_;
+            curl_off_t sendspeed_;
         };
 
-        // Why are these not in the standard library?
-        inline std::string ltrim(std::string const& s)
-        {
-            using namespace std;
-            return string(
-                find_if(s.begin(), s.end(), not1(ptr_fun<int, int>(isspace))),
-                s.end());
-        }
-
-        inline std::string rtrim(std::string const& s)
-        {
-            using namespace std;
-            return string(
-                s.begin(),
-                find_if(s.rbegin(), s.rend(), not1(ptr_fun<int, int>(isspace))).base());
-        }
-
-        inline std::string trim(std::string const& s)
-        {
-            return ltrim(rtrim(s));
-        }
-
-        inline std::string tolower(std::string const& s)
-        {
-            std::string result(s);
-            std::transform(result.begin(), result.end(), result.begin(), (int(*)(int))std::tolower);
-            return result;
-        }
-
         //
-        // gzip compression support
+        // handle_pool
+        //  A process-wide cache of idle handles, keyed by scheme+host+port.
+        //  curl_easy_reset leaves a handle's live connections, DNS cache and
+        //  TLS session cache alone, so a borrowed handle can reuse a
+        //  keep-alive connection instead of handshaking all over again.
         //
-        std::string gzip(std::string const& input)
+        //  maxperhost bounds the number of idle handles retained for each
+        //  key; it does not limit concurrency. Borrowers beyond the cap get
+        //  fresh handles, which are simply destroyed when given back. Handles
+        //  idle for longer than idletimeout seconds are evicted lazily.
+        //
+        class handle_pool
         {
-            z_stream stream;
-
-            stream.next_in = (unsigned char*)input.data();
-            stream.avail_in = input.size();
-
-            stream.zalloc = Z_NULL;
-            stream.zfree = Z_NULL;
-            stream.opaque = Z_NULL;
-
-            if (Z_OK != deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS+16,
-                    MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY))
+        public:
+            handle_pool()
+                : maxperhost_(8), idletimeout_(30)
             {
-                throw std::runtime_error("error initializing deflate");
             }
 
-            // Add 12 for old versions of zlib that don't correctly include header size
-            unsigned long maxLen = 12 + deflateBound(&stream, input.size());
-            std::vector<unsigned char> dest(maxLen);
-
-            stream.next_out = &dest.front();
-            stream.avail_out = dest.size();
-
-            if (Z_STREAM_END != deflate(&stream, Z_FINISH))
+            ~handle_pool()
             {
-                deflateEnd(&stream);
-                throw std::runtime_error("failed to completely deflate");
+                for (idlemap::iterator it = idle_.begin(); it != idle_.end(); ++it)
+                {
+                    for (size_t i = 0; i < it->second.size(); ++i)
+                        delete it->second[i].curl;
+                }
             }
 
-            std::string result((const char*)&dest.front(), (size_t)stream.total_out);
-            deflateEnd(&stream);
-            return result;
-        }
-
-        std::string gunzip(std::string const& input)
-        {
-            const unsigned long INIT_BUFFER_SIZE = 10240;
-            z_stream stream;
-            stream.zalloc = Z_NULL;
-            stream.zfree = Z_NULL;
-            stream.opaque = Z_NULL;
-            stream.next_in = (unsigned char*)input.data();
-            stream.avail_in = input.size();
-
-            if (Z_OK != inflateInit2(&stream, MAX_WBITS+16))
+            void configure(size_t maxperhost, int idletimeout)
             {
-                throw std::runtime_error("error initializing inflate");
+                std::vector<handle*> doomed;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    maxperhost_ = maxperhost;
+                    idletimeout_ = idletimeout;
+                    sweep(doomed);
+                }
+                destroy(doomed);
             }
 
-            // Allocate an initial buffer
-            std::vector<unsigned char> dest(INIT_BUFFER_SIZE);
-            stream.next_out = &dest.front();
-            stream.avail_out = dest.size();
-
-            int rc;
-            do
+            handle* acquire(std::string const& key)
             {
-                rc = inflate(&stream, Z_SYNC_FLUSH);
+                handle* result = NULL;
+                std::vector<handle*> doomed;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    sweep(doomed);
+                    idlemap::iterator it = idle_.find(key);
+                    if (it != idle_.end() && !it->second.empty())
+                    {
+                        // Most recently used first; its connection is the
+                        // least likely to have been closed by the server
+                        result = it->second.back().curl;
+                        it->second.pop_back();
+                    }
+                }
+                destroy(doomed);
+                return result ? result : new handle();
+            }
 
-                if (rc == Z_OK)
+            void release(std::string const& key, handle* curl)
+            {
+                // Don't leak cookies or dangling callback pointers from one
+                // borrower to the next. Idle handles also let go of any
+                // session cache, which may be destroyed while they wait.
+                try
                 {
-                    // Reallocate buffer and continue
-                    size_t oldSize = dest.size();
-                    dest.resize(dest.size() * 2);
-                    stream.next_out = &dest.front() + oldSize;
-                    stream.avail_out = dest.size() - oldSize;
+                    curl->share(NULL);
+                    curl->setopt(CURLOPT_COOKIELIST, "ALL");
+                    curl->reset();
                 }
-                else if (rc != Z_STREAM_END)
+                catch (curl_error const&)
                 {
-                    inflateEnd(&stream);
-                    std::cerr << "Error code: " << rc << "\n"
-                              << "Message: " << stream.msg << "\n";
-                    // TODO: use std::vector for buffering; better exception safety
-                    // also, no need to explicitly copy when reallocating
-                    throw std::runtime_error("failed to completely inflate");
+                    delete curl;
+                    return;
                 }
-            } while(rc != Z_STREAM_END);
 
-            inflateEnd(&stream);
-            return std::string((const char*)&dest.front(), (size_t)stream.total_out);
-        }
+                std::vector<handle*> doomed;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    sweep(doomed);
+                    std::deque<entry>& slot = idle_[key];
+                    if (slot.size() < maxperhost_)
+                        slot.push_back(entry(curl));
+                    else
+                        doomed.push_back(curl);
+                }
+                destroy(doomed);
+            }
 
-        extern "C" size_t streamfunc(void* ptr, size_t size, size_t nmemb, std::ostream* out)
-        {
-            (*out).write(static_cast<char*>(ptr), size * nmemb);
-            return size * nmemb;
-        }
+        private:
+            typedef std::chrono::steady_clock clock;
 
-        extern "C" size_t headerfunc(void* ptr, size_t size, size_t nmemb, httpresponse* resp)
-        {
-            std::string header(static_cast<const char*>(ptr), size * nmemb);
+            struct entry
+            {
+                explicit entry(handle* h)
+                    : curl(h), since(clock::now())
+                { }
+
+                handle* curl;
+                clock::time_point since;
+            };
 
-            // Per RFC 2616, each header line consists of a token followed
-            // by a ':' and then a value, preceded by any amount of leading
-            // whitespace.
-            size_t cpos = header.find(':');
-            if (cpos != std::string::npos)
+            typedef std::map<std::string, std::deque<entry> > idlemap;
+
+            // Collects expired or surplus handles; must hold mutex_
+            void sweep(std::vector<handle*>& doomed)
             {
-                std::string name = tolower(header.substr(0, cpos));
-                std::string value = trim(header.substr(cpos+1));
-                resp->headers[name] = value;
+                clock::time_point cutoff = clock::now() - std::chrono::seconds(idletimeout_);
+                idlemap::iterator it = idle_.begin();
+                while (it != idle_.end())
+                {
+                    std::deque<entry>& slot = it->second;
+                    while (!slot.empty() &&
+                           (slot.size() > maxperhost_ || slot.front().since < cutoff))
+                    {
+                        doomed.push_back(slot.front().curl);
+                        slot.pop_front();
+                    }
+                    if (slot.empty())
+                        idle_.erase(it++);
+                    else
+                        ++it;
+                }
             }
 
-            return size * nmemb;
-        }
-
-        std::string serialize(httpparams const& params)
-        {
-            // Serialize HTTP params in a URL-encoded form appropriate
-            // for a query string or POST-fields request body.
-            std::stringstream ss;
-            for (httpparams::const_iterator it = params.begin();
-                    it != params.end(); ++it)
+            // Closing connections can block, so this happens outside the lock
+            static void destroy(std::vector<handle*> const& doomed)
             {
-                if (it != params.begin())
-                    ss << "&";
-                char* name = curl_easy_escape(NULL, it->first.c_str(), it->first.size());
-                char* value = curl_easy_escape(NULL, it->second.c_str(), it->second.size());
-                ss << name << "=" << value;
-                curl_free(name);
-                curl_free(value);
+                for (size_t i = 0; i < doomed.size(); ++i)
+                    delete doomed[i];
             }
-            return ss.str();
-        }
 
-        std::string query(std::string const& url, httpparams const& params)
-        {
-            return url + "?" + serialize(params);
-        }
+            std::mutex mutex_;
+            idlemap idle_;
+            size_t maxperhost_;
+            int idletimeout_;
+        };
 
+        // Must be defined after moo so that it is destroyed before
+        // curl_global_cleanup runs
+        static handle_pool pool;
 
-        void prepare_basic(handle&              curl,
-                           httpresponse &       resp,
-                           std::ostream &       out,
-                           std::string const&   url,
-                           int                  timeout,
-                           bool                 accept_compression = true)
+        //
+        // multi
+        //  A thin wrapper around a curl multi handle, for driving several
+        //  transfers from a single thread.
+        //
+        class multi
         {
-            curl.reset();
-            curl.setopt(CURLOPT_URL, url.c_str());
-            curl.setopt(CURLOPT_NOSIGNAL, 1);
-            curl.setopt(CURLOPT_NOPROGRESS, 1);
-            curl.setopt(CURLOPT_WRITEFUNCTION, &streamfunc);
-            curl.setopt(CURLOPT_WRITEDATA, &out);
-            curl.setopt(CURLOPT_HEADERFUNCTION, &headerfunc);
-            curl.setopt(CURLOPT_HEADERDATA, &resp);
-            curl.setopt(CURLOPT_COOKIEFILE, ""); // turns on cookie engine
-            curl.setopt(CURLOPT_TIMEOUT, timeout);
+        public:
+            multi()
+                : multi_(curl_multi_init())
+            {
+                if (multi_ == NULL)
+                    throw std::runtime_error("curl_multi_init failed");
+            }
 
-            if (accept_compression)
-                curl.add_header("Accept-encoding: gzip");
-        }
+            ~multi()
+            {
+                curl_multi_cleanup(multi_);
+            }
 
-        void prepare_post(handle&               curl,
-                          const void*           data,
-                          size_t                size,
-                          bool                  is_compressed = false)
-        {
-            curl.setopt(CURLOPT_POST, 1);
-            curl.setopt(CURLOPT_POSTFIELDS, data);
-            curl.setopt(CURLOPT_POSTFIELDSIZE, size);
+            void add(handle& curl)
+            {
+                curl.apply();
+                check(curl_multi_add_handle(multi_, curl.get()));
+            }
 
-            // In keeping with hurl's "do the wrong thing easily"
-            // philosophy, disable "Expect: 100-continue" header
-            curl.add_header("Expect:");
+            void remove(CURL* curl)
+            {
+                check(curl_multi_remove_handle(multi_, curl));
+            }
 
-            // Include appropriate content-encoding with compressed POST data
-            if (is_compressed)
-                curl.add_header("Content-Encoding: gzip");
-        }
+            // Returns the number of transfers still running
+            int perform()
+            {
+                int running = 0;
+                check(curl_multi_perform(multi_, &running));
+                return running;
+            }
 
-        void process_response(handle&           curl,
-                              httpresponse&     response)
-        {
-            if (response.headers.count("content-encoding"))
+            // Wait for activity on any transfer, or until wakeup() is called
+            void poll(int timeout_ms)
             {
-                if (tolower(response.headers["content-encoding"]) == "gzip")
-                {
-                    response.body = gunzip(response.body);
-                }
+                check(curl_multi_poll(multi_, NULL, 0, timeout_ms, NULL));
             }
-        }
 
-        httpresponse get(handle&                curl,
-                         std::string const&     url,
-                         int                    timeout)
-        {
-            httpresponse result;
-            std::ostringstream ss;
-            prepare_basic(curl, result, ss, url, timeout);
-            curl.perform();
-            curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
-            // Copy the stream buffer into the response
-            result.body.assign(ss.str());
-            process_response(curl, result);
-            return result;
-        }
+            void wakeup()
+            {
+                check(curl_multi_wakeup(multi_));
+            }
 
-        httpresponse post(handle&               curl,
-                          std::string const&    url,
-                          std::string           data,
-                          int                   timeout)
-        {
-            httpresponse result;
-            std::ostringstream ss;
-            prepare_basic(curl, result, ss, url, timeout);
+            // Tell curl that a socket is ready (flags are CURL_CSELECT_*), or
+            // that its timeout has expired (CURL_SOCKET_TIMEOUT)
+            void action(curl_socket_t socket, int flags)
+            {
+                int running = 0;
+                check(curl_multi_socket_action(multi_, socket, flags, &running));
+            }
 
-            // TEMP: apply gzip compression to request data over 10KB
-            bool compressed = false;
-            if (data.size() > 10240)
+            // Pops the next finished transfer, if any
+            bool next(CURL*& curl, int& code)
             {
-                data = gzip(data);
-                compressed = true;
+                int queued;
+                while (CURLMsg* msg = curl_multi_info_read(multi_, &queued))
+                {
+                    if (msg->msg == CURLMSG_DONE)
+                    {
+                        curl = msg->easy_handle;
+                        code = msg->data.result;
+                        return true;
+                    }
+                }
+                return false;
             }
 
-            prepare_post(curl, data.data(), data.size(), compressed);
-            curl.perform();
-            curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
-            result.body.assign(ss.str());
-            process_response(curl, result);
-            return result;
+            template<typename T, typename U>
+            void setopt(T option, U value)
+            {
+                check(curl_multi_setopt(multi_, option, value));
+            }
+
+            CURLM* get() const
+            {
+                return multi_;
+            }
+
+        private:
+            static void check(CURLMcode code)
+            {
+                if (CURLM_OK != code)
+                    throw std::runtime_error(curl_multi_strerror(code));
+            }
+
+            CURLM* multi_;
+
+            // Noncopyable
+            multi(multi const&);
+            multi& operator=(multi const&);
+        };
+
+#ifdef HURL_EPOLL
+        extern "C" int socketfunc(CURL*, curl_socket_t, int, void*, void*);
+        extern "C" int timerfunc(CURLM*, long, void*);
+#endif
+
+        //
+        // reactor
+        //  Waits for and acts on the activity of a multi handle's transfers.
+        //  With epoll, it uses curl's socket interface: curl says which
+        //  sockets it is interested in (CURLMOPT_SOCKETFUNCTION) and when it
+        //  next needs to be called back (CURLMOPT_TIMERFUNCTION), and only
+        //  the sockets that are ready are handed back to it, so the cost of
+        //  a wait doesn't grow with the number of transfers. An eventfd
+        //  interrupts the wait. Elsewhere it falls back to curl_multi_poll,
+        //  which does the same job less scalably.
+        //
+        class reactor
+        {
+        public:
+            explicit reactor(multi& m)
+                : multi_(m)
+#ifdef HURL_EPOLL
+                , epoll_(::epoll_create1(EPOLL_CLOEXEC)),
+                  event_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+                  timer_(false)
+#endif
+            {
+#ifdef HURL_EPOLL
+                if (epoll_ < 0 || event_ < 0)
+                {
+                    close();
+                    throw std::runtime_error("cannot create epoll instance");
+                }
+                epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.fd = event_;
+                ::epoll_ctl(epoll_, EPOLL_CTL_ADD, event_, &ev);
+
+                multi_.setopt(CURLMOPT_SOCKETFUNCTION, &socketfunc);
+                multi_.setopt(CURLMOPT_SOCKETDATA, this);
+                multi_.setopt(CURLMOPT_TIMERFUNCTION, &timerfunc);
+                multi_.setopt(CURLMOPT_TIMERDATA, this);
+#endif
+            }
+
+            ~reactor()
+            {
+#ifdef HURL_EPOLL
+                // The multi handle outlives us, and calls back as it closes
+                // its connections
+                curl_multi_setopt(multi_.get(), CURLMOPT_SOCKETFUNCTION, NULL);
+                curl_multi_setopt(multi_.get(), CURLMOPT_TIMERFUNCTION, NULL);
+                close();
+#endif
+            }
+
+            // Wait up to timeout_ms for something to happen, and let curl
+            // deal with it
+            void wait(int timeout_ms)
+            {
+#ifdef HURL_EPOLL
+                if (timer_)
+                {
+                    long long due = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline_ - std::chrono::steady_clock::now()).count();
+                    timeout_ms = (int)std::max(0LL, std::min<long long>(due, timeout_ms));
+                }
+
+                epoll_event events[64];
+                int n = ::epoll_wait(epoll_, events, 64, timeout_ms);
+                for (int i = 0; i < n; ++i)
+                {
+                    if (events[i].data.fd == event_)
+                    {
+                        uint64_t count;
+                        while (::read(event_, &count, sizeof(count)) > 0)
+                            ;
+                        continue;
+                    }
+
+                    int flags = 0;
+                    if (events[i].events & EPOLLIN)
+                        flags |= CURL_CSELECT_IN;
+                    if (events[i].events & EPOLLOUT)
+                        flags |= CURL_CSELECT_OUT;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP))
+                        flags |= CURL_CSELECT_ERR;
+                    multi_.action(events[i].data.fd, flags);
+                }
+
+                // curl also wants calling when its timer runs out; and if
+                // the wait timed out, in case it didn't reset the timer
+                if (n == 0 || (timer_ && std::chrono::steady_clock::now() >= deadline_))
+                {
+                    timer_ = false;
+                    multi_.action(CURL_SOCKET_TIMEOUT, 0);
+                }
+#else
+                multi_.poll(timeout_ms);
+                multi_.perform();
+#endif
+            }
+
+            // Interrupt a wait, from any thread
+            void wakeup()
+            {
+#ifdef HURL_EPOLL
+                uint64_t one = 1;
+                if (::write(event_, &one, sizeof(one)) < 0)
+                {
+                    // Only fails if the counter is saturated, and then the
+                    // reactor has plenty of wakeups pending already
+                }
+#else
+                multi_.wakeup();
+#endif
+            }
+
+#ifdef HURL_EPOLL
+            // CURLMOPT_SOCKETFUNCTION
+            void watch(curl_socket_t socket, int what)
+            {
+                if (what == CURL_POLL_REMOVE)
+                {
+                    // Fails harmlessly if curl has already closed it
+                    ::epoll_ctl(epoll_, EPOLL_CTL_DEL, socket, NULL);
+                    return;
+                }
+
+                epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = ((what & CURL_POLL_IN) ? (uint32_t)EPOLLIN : 0u) |
+                            ((what & CURL_POLL_OUT) ? (uint32_t)EPOLLOUT : 0u);
+                ev.data.fd = socket;
+                if (::epoll_ctl(epoll_, EPOLL_CTL_MOD, socket, &ev) != 0 && errno == ENOENT)
+                    ::epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &ev);
+            }
+
+            // CURLMOPT_TIMERFUNCTION; -1 cancels the timer
+            void schedule(long timeout_ms)
+            {
+                timer_ = (timeout_ms >= 0);
+                if (timer_)
+                    deadline_ = std::chrono::steady_clock::now() +
+                                std::chrono::milliseconds(timeout_ms);
+            }
+#endif
+
+        private:
+#ifdef HURL_EPOLL
+            void close()
+            {
+                if (epoll_ >= 0)
+                    ::close(epoll_);
+                if (event_ >= 0)
+                    ::close(event_);
+            }
+#endif
+
+            multi& multi_;
+#ifdef HURL_EPOLL
+            int epoll_;
+            int event_;
+            bool timer_;
+            std::chrono::steady_clock::time_point deadline_;
+#endif
+
+            // Noncopyable
+            reactor(reactor const&);
+            reactor& operator=(reactor const&);
+        };
+
+#ifdef HURL_EPOLL
+        extern "C" int socketfunc(CURL*, curl_socket_t socket, int what, void* r, void*)
+        {
+            static_cast<reactor*>(r)->watch(socket, what);
+            return 0;
+        }
+
+        extern "C" int timerfunc(CURLM*, long timeout_ms, void* r)
+        {
+            static_cast<reactor*>(r)->schedule(timeout_ms);
+            return 0;
+        }
+#endif
+
+        inline std::string tolower(std::string const& s)
+        {
+            std::string result(s);
+            std::transform(result.begin(), result.end(), result.begin(), (int(*)(int))std::tolower);
+            return result;
+        }
+
+        //
+        // gzip compression support
+        //
+        // Compress a whole buffer with one of compressionpolicy's encodings.
+        // level -1 picks a default suited to request bodies.
+        std::string encode(const char* data, size_t size, int encoding, int level)
+        {
+            if (encoding == compressionpolicy::gzip || encoding == compressionpolicy::deflate)
+            {
+                z_stream stream;
+
+                stream.next_in = (unsigned char*)data;
+                stream.avail_in = size;
+
+                stream.zalloc = Z_NULL;
+                stream.zfree = Z_NULL;
+                stream.opaque = Z_NULL;
+
+                // "deflate" in HTTP means the zlib format, not raw deflate
+                int bits = (encoding == compressionpolicy::gzip) ? MAX_WBITS+16 : MAX_WBITS;
+                if (Z_OK != deflateInit2(&stream, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+                        Z_DEFLATED, bits, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY))
+                {
+                    throw std::runtime_error("error initializing deflate");
+                }
+
+                // Add 12 for old versions of zlib that don't correctly include header size
+                unsigned long maxLen = 12 + deflateBound(&stream, size);
+                std::vector<unsigned char> dest(maxLen);
+
+                stream.next_out = &dest.front();
+                stream.avail_out = dest.size();
+
+                if (Z_STREAM_END != deflate(&stream, Z_FINISH))
+                {
+                    deflateEnd(&stream);
+                    throw std::runtime_error("failed to completely deflate");
+                }
+
+                std::string result((const char*)&dest.front(), (size_t)stream.total_out);
+                deflateEnd(&stream);
+                return result;
+            }
+#ifdef HURL_WITH_ZSTD
+            if (encoding == compressionpolicy::zstd)
+            {
+                std::string result(ZSTD_compressBound(size), '\0');
+                size_t n = ZSTD_compress(&result[0], result.size(), data, size,
+                                         level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+                if (ZSTD_isError(n))
+                    throw std::runtime_error("failed to compress with zstd");
+                result.resize(n);
+                return result;
+            }
+#endif
+#ifdef HURL_WITH_BROTLI
+            if (encoding == compressionpolicy::brotli)
+            {
+                // Brotli's own default, 11, is meant for static assets and
+                // is far too slow to spend on every request
+                size_t n = BrotliEncoderMaxCompressedSize(size);
+                std::string result(n, '\0');
+                if (!BrotliEncoderCompress(level < 0 ? 5 : level, BROTLI_DEFAULT_WINDOW,
+                                           BROTLI_MODE_GENERIC, size, (const uint8_t*)data,
+                                           &n, (uint8_t*)&result[0]))
+                    throw std::runtime_error("failed to compress with brotli");
+                result.resize(n);
+                return result;
+            }
+#endif
+            throw std::runtime_error("compression algorithm not supported by this build");
+        }
+
+        // The Content-Encoding name for one of compressionpolicy's encodings
+        const char* encoding_name(int encoding)
+        {
+            switch (encoding)
+            {
+            case compressionpolicy::gzip:       return "gzip";
+            case compressionpolicy::deflate:    return "deflate";
+            case compressionpolicy::zstd:       return "zstd";
+            case compressionpolicy::brotli:     return "br";
+            }
+            return NULL;
+        }
+
+        // What to advertise in Accept-Encoding: everything make_decoder
+        // can decode
+        const char* accept_encoding()
+        {
+            return "gzip, deflate"
+#ifdef HURL_WITH_ZSTD
+                   ", zstd"
+#endif
+#ifdef HURL_WITH_BROTLI
+                   ", br"
+#endif
+                   ;
+        }
+
+        bool supported(int encoding)
+        {
+            switch (encoding)
+            {
+            case compressionpolicy::none:
+            case compressionpolicy::gzip:
+            case compressionpolicy::deflate:
+                return true;
+#ifdef HURL_WITH_ZSTD
+            case compressionpolicy::zstd:
+                return true;
+#endif
+#ifdef HURL_WITH_BROTLI
+            case compressionpolicy::brotli:
+                return true;
+#endif
+            }
+            return false;
+        }
+
+        std::string gzip(std::string const& input)
+        {
+            return encode(input.data(), input.size(), compressionpolicy::gzip, -1);
+        }
+
+        //
+        // compressor
+        //  Applies a compressionpolicy to request bodies. In adaptive mode
+        //  it compresses a sample of each body first, and keeps a running
+        //  average of the upload speed seen on completed requests, so it
+        //  can tell whether compressing would get the body there sooner.
+        //
+        class compressor
+        {
+        public:
+            explicit compressor(compressionpolicy const& policy)
+                : policy_(policy), link_(0), compressed_(0)
+            {
+                if (!supported(policy.algorithm))
+                    throw std::runtime_error("compression algorithm not supported by this build");
+            }
+
+            // Compress data in place if it should be, returning the
+            // Content-Encoding it now has, or NULL if it was left alone
+            const char* apply(std::string& data)
+            {
+                if (policy_.algorithm == compressionpolicy::none ||
+                    data.size() <= policy_.threshold)
+                    return NULL;
+
+                if (policy_.adaptive)
+                {
+                    size_t n = std::min<size_t>(data.size(), 65536);
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    std::string sample = encode(data.data(), n, policy_.algorithm, policy_.level);
+                    double seconds = std::chrono::duration<double>(
+                                        std::chrono::steady_clock::now() - start).count();
+
+                    // Hardly shrinks: already compressed, or random
+                    double ratio = double(sample.size()) / n;
+                    if (ratio > 0.9)
+                        return NULL;
+
+                    // Compressing pays if it takes less time than it saves
+                    // on the wire: size/speed < size * (1 - ratio)/link
+                    double speed = n / std::max(seconds, 1e-9);
+                    double link = 0;
+                    bool probe = false;
+                    {
+                        // Compressed bodies are often too small to measure
+                        // the link by, so now and then send one as it is
+                        // to keep the estimate fresh
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        link = link_;
+                        probe = data.size() >= 65536 && ++compressed_ % 16 == 0;
+                    }
+                    if (probe || (link > 0 && link >= speed * (1 - ratio)))
+                        return NULL;
+
+                    if (n == data.size())
+                    {
+                        data.swap(sample);
+                        return encoding_name(policy_.algorithm);
+                    }
+                }
+
+                data = encode(data.data(), data.size(), policy_.algorithm, policy_.level);
+                return encoding_name(policy_.algorithm);
+            }
+
+            // Record the upload speed of a completed request
+            void observe(double bytes, double seconds)
+            {
+                // Small bodies measure latency rather than bandwidth
+                if (!policy_.adaptive || bytes < 65536 || seconds <= 0)
+                    return;
+                std::lock_guard<std::mutex> lock(mutex_);
+                double speed = bytes / seconds;
+                link_ = (link_ == 0) ? speed : 0.8 * link_ + 0.2 * speed;
+            }
+
+        private:
+            compressionpolicy policy_;
+            std::mutex mutex_;
+            double link_;           // Bytes per second, 0 until measured
+            unsigned compressed_;
+        };
+
+        // Installed by setcompression; read without locking on every post
+        static std::shared_ptr<compressor> global_compression(
+            new compressor(compressionpolicy()));
+
+        std::shared_ptr<compressor> global_compressor()
+        {
+            return std::atomic_load(&global_compression);
+        }
+
+        //
+        // deflater
+        //  Incremental gzip encoder, the counterpart of inflater below. It
+        //  pulls plain input from a source through a fixed-size window and
+        //  fills whatever output buffer it is given, so an upload of any
+        //  size is compressed in constant memory.
+        //
+        class deflater
+        {
+        public:
+            explicit deflater(int level = Z_DEFAULT_COMPRESSION)
+                : window_(65536), eof_(false), done_(false)
+            {
+                stream_.zalloc = Z_NULL;
+                stream_.zfree = Z_NULL;
+                stream_.opaque = Z_NULL;
+                stream_.next_in = Z_NULL;
+                stream_.avail_in = 0;
+
+                if (Z_OK != deflateInit2(&stream_, level, Z_DEFLATED, MAX_WBITS+16,
+                                         8, Z_DEFAULT_STRATEGY))
+                    throw std::runtime_error("error initializing deflate");
+            }
+
+            ~deflater()
+            {
+                deflateEnd(&stream_);
+            }
+
+            // Fill up to size bytes of out, reading from source as needed.
+            // Returns 0 once the compressed stream is complete.
+            size_t read(bodysource const& source, char* out, size_t size)
+            {
+                stream_.next_out = (unsigned char*)out;
+                stream_.avail_out = size;
+
+                while (stream_.avail_out > 0 && !done_)
+                {
+                    if (stream_.avail_in == 0 && !eof_)
+                    {
+                        size_t n = source(&window_.front(), window_.size());
+                        eof_ = (n == 0);
+                        stream_.next_in = (unsigned char*)&window_.front();
+                        stream_.avail_in = n;
+                    }
+
+                    int rc = deflate(&stream_, eof_ ? Z_FINISH : Z_NO_FLUSH);
+                    if (rc == Z_STREAM_END)
+                        done_ = true;
+                    else if (rc != Z_OK && rc != Z_BUF_ERROR)
+                        throw std::runtime_error("failed to completely deflate");
+                }
+                return size - stream_.avail_out;
+            }
+
+        private:
+            z_stream stream_;
+            std::vector<char> window_;
+            bool eof_;
+            bool done_;
+
+            // Noncopyable
+            deflater(deflater const&);
+            deflater& operator=(deflater const&);
+        };
+
+        //
+        // decoder
+        //  Interface to the incremental content decoders below. Compressed
+        //  chunks are fed in as they arrive and decompressed output is
+        //  handed to a sink through a fixed-size window, so memory use
+        //  doesn't grow with the body.
+        //
+        class decoder
+        {
+        public:
+            decoder()
+                : window_(65536), done_(false), elapsed_(0)
+            { }
+
+            virtual ~decoder()
+            { }
+
+            // Returns false if the sink asked to stop
+            virtual bool write(const char* data, size_t size, bodysink const& sink) = 0;
+
+            // Whether the input so far ends with a complete stream
+            bool finished() const
+            {
+                return done_;
+            }
+
+            // Seconds spent inside the codec so far
+            double elapsed() const
+            {
+                return std::chrono::duration<double>(elapsed_).count();
+            }
+
+        protected:
+            std::vector<char> window_;
+            bool done_;
+            std::chrono::steady_clock::duration elapsed_;
+
+        private:
+            // Noncopyable
+            decoder(decoder const&);
+            decoder& operator=(decoder const&);
+        };
+
+        //
+        // inflater
+        //  Incremental gzip (or zlib) decoder. Concatenated gzip members are
+        //  decoded back to back.
+        //
+        class inflater : public decoder
+        {
+        public:
+            inflater()
+            {
+                stream_.zalloc = Z_NULL;
+                stream_.zfree = Z_NULL;
+                stream_.opaque = Z_NULL;
+                stream_.next_in = Z_NULL;
+                stream_.avail_in = 0;
+
+                // +32 detects gzip or zlib headers, for Content-Encoding
+                // gzip and deflate respectively
+                if (Z_OK != inflateInit2(&stream_, MAX_WBITS+32))
+                    throw std::runtime_error("error initializing inflate");
+            }
+
+            ~inflater()
+            {
+                inflateEnd(&stream_);
+            }
+
+            bool write(const char* data, size_t size, bodysink const& sink)
+            {
+                stream_.next_in = (unsigned char*)data;
+                stream_.avail_in = size;
+
+                while (stream_.avail_in > 0)
+                {
+                    if (done_)
+                    {
+                        // Another gzip member follows the one just finished
+                        inflateReset(&stream_);
+                        done_ = false;
+                    }
+
+                    stream_.next_out = (unsigned char*)&window_.front();
+                    stream_.avail_out = window_.size();
+
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    int rc = inflate(&stream_, Z_NO_FLUSH);
+                    elapsed_ += std::chrono::steady_clock::now() - start;
+                    if (rc == Z_STREAM_END)
+                        done_ = true;
+                    else if (rc != Z_OK && rc != Z_BUF_ERROR)
+                        throw std::runtime_error("failed to completely inflate");
+
+                    size_t produced = window_.size() - stream_.avail_out;
+                    if (produced > 0 && !sink(&window_.front(), produced))
+                        return false;
+
+                    // Z_BUF_ERROR means no progress was possible with the
+                    // output space given, which can't happen with an empty
+                    // window; treat it as corruption rather than spin
+                    if (rc == Z_BUF_ERROR && produced == 0)
+                        throw std::runtime_error("failed to completely inflate");
+                }
+                return true;
+            }
+
+        private:
+            z_stream stream_;
+        };
+
+#ifdef HURL_WITH_ZSTD
+        //
+        // zstd_decoder
+        //  Incremental zstd decoder. Concatenated frames are decoded back to
+        //  back.
+        //
+        class zstd_decoder : public decoder
+        {
+        public:
+            zstd_decoder()
+                : stream_(ZSTD_createDStream())
+            {
+                if (stream_ == NULL || ZSTD_isError(ZSTD_initDStream(stream_)))
+                {
+                    ZSTD_freeDStream(stream_);
+                    throw std::runtime_error("error initializing zstd");
+                }
+            }
+
+            ~zstd_decoder()
+            {
+                ZSTD_freeDStream(stream_);
+            }
+
+            bool write(const char* data, size_t size, bodysink const& sink)
+            {
+                ZSTD_inBuffer in = { data, size, 0 };
+                ZSTD_outBuffer out;
+                do
+                {
+                    out.dst = &window_.front();
+                    out.size = window_.size();
+                    out.pos = 0;
+
+                    size_t consumed = in.pos;
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    size_t rc = ZSTD_decompressStream(stream_, &out, &in);
+                    elapsed_ += std::chrono::steady_clock::now() - start;
+                    if (ZSTD_isError(rc))
+                        throw std::runtime_error("failed to completely decompress zstd");
+
+                    // 0 means a frame just ended, with nothing held back. A
+                    // call that did nothing (checking for more output after
+                    // a full window) says nothing either way.
+                    if (rc == 0)
+                        done_ = true;
+                    else if (in.pos > consumed || out.pos > 0)
+                        done_ = false;
+
+                    if (out.pos > 0 && !sink(&window_.front(), out.pos))
+                        return false;
+
+                    // A full window may mean there's more output to come
+                } while (in.pos < in.size || out.pos == out.size);
+                return true;
+            }
+
+        private:
+            ZSTD_DStream* stream_;
+        };
+#endif
+
+#ifdef HURL_WITH_BROTLI
+        //
+        // brotli_decoder
+        //  Incremental brotli decoder.
+        //
+        class brotli_decoder : public decoder
+        {
+        public:
+            brotli_decoder()
+                : state_(BrotliDecoderCreateInstance(NULL, NULL, NULL))
+            {
+                if (state_ == NULL)
+                    throw std::runtime_error("error initializing brotli");
+            }
+
+            ~brotli_decoder()
+            {
+                BrotliDecoderDestroyInstance(state_);
+            }
+
+            bool write(const char* data, size_t size, bodysink const& sink)
+            {
+                const uint8_t* next_in = (const uint8_t*)data;
+                size_t avail_in = size;
+                for (;;)
+                {
+                    uint8_t* next_out = (uint8_t*)&window_.front();
+                    size_t avail_out = window_.size();
+
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    BrotliDecoderResult rc = BrotliDecoderDecompressStream(
+                        state_, &avail_in, &next_in, &avail_out, &next_out, NULL);
+                    elapsed_ += std::chrono::steady_clock::now() - start;
+                    if (rc == BROTLI_DECODER_RESULT_ERROR)
+                        throw std::runtime_error("failed to completely decompress brotli");
+
+                    size_t produced = window_.size() - avail_out;
+                    if (produced > 0 && !sink(&window_.front(), produced))
+                        return false;
+
+                    if (rc == BROTLI_DECODER_RESULT_SUCCESS)
+                    {
+                        // A brotli stream can't be followed by anything
+                        if (avail_in > 0)
+                            throw std::runtime_error("trailing data after brotli stream");
+                        done_ = true;
+                        return true;
+                    }
+                    if (rc == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT)
+                        return true;
+                }
+            }
+
+        private:
+            BrotliDecoderState* state_;
+        };
+#endif
+
+        // A decoder for the given Content-Encoding, or NULL if the body is
+        // to be passed on as it is
+        std::unique_ptr<decoder> make_decoder(std::string_view encoding)
+        {
+            std::unique_ptr<decoder> result;
+            if (iequals(encoding, "gzip") || iequals(encoding, "x-gzip") ||
+                iequals(encoding, "deflate"))
+                result.reset(new inflater());
+#ifdef HURL_WITH_ZSTD
+            else if (iequals(encoding, "zstd"))
+                result.reset(new zstd_decoder());
+#endif
+#ifdef HURL_WITH_BROTLI
+            else if (iequals(encoding, "br"))
+                result.reset(new brotli_decoder());
+#endif
+            return result;
+        }
+
+        // Body sink that appends to a string
+        struct string_sink
+        {
+            explicit string_sink(std::string* out)
+                : out(out)
+            { }
+
+            bool operator()(const char* data, size_t size) const
+            {
+                out->append(data, size);
+                return true;
+            }
+
+            std::string* out;
+        };
+
+        // Write all of size bytes at offset, retrying short writes
+        void write_at(int fd, const char* data, size_t size, off_t offset)
+        {
+            while (size > 0)
+            {
+                ssize_t n = ::pwrite(fd, data, size, offset);
+                if (n < 0)
+                {
+                    int error = errno;
+                    if (error == EINTR)
+                        continue;
+#ifdef O_DIRECT
+                    // Some filesystems accept O_DIRECT at open only to
+                    // refuse the writes; go through the page cache instead
+                    int flags = ::fcntl(fd, F_GETFL);
+                    if (error == EINVAL && flags >= 0 && (flags & O_DIRECT) &&
+                        ::fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0)
+                        continue;
+#endif
+                    throw std::runtime_error("failed to write response body");
+                }
+                data += n;
+                size -= n;
+                offset += n;
+            }
+        }
+
+        //
+        // file_writer
+        //  Writes a downloaded body to a file, from a given offset, without
+        //  going through iostreams: chunks are gathered into one large
+        //  buffer, aligned for O_DIRECT, which is written with pwrite when
+        //  it fills, so the kernel sees a few big writes rather than one per
+        //  curl callback. See downloadoptions for direct, dropcache and
+        //  preallocate.
+        //
+        //  With O_DIRECT, every write but the last is a whole buffer at an
+        //  aligned offset; the unaligned tail is written once O_DIRECT has
+        //  been turned off again.
+        //
+        class file_writer
+        {
+        public:
+            static const size_t alignment = 4096;
+
+            file_writer(std::string const&      path,
+                        off_t                   offset,
+                        bool                    truncate,
+                        downloadoptions const&  options)
+                : fd_(-1), buffer_(NULL), used_(0), offset_(offset), flushed_(offset),
+                  direct_(false), dropcache_(options.dropcache),
+                  preallocate_(options.preallocate)
+            {
+                size_ = std::max<size_t>(options.buffersize, 64 << 10);
+                size_ = (size_ + alignment - 1) / alignment * alignment;
+
+                int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0);
+#ifdef O_DIRECT
+                if (options.direct && offset % alignment == 0)
+                {
+                    // Not every filesystem takes it (tmpfs doesn't)
+                    fd_ = ::open(path.c_str(), flags | O_DIRECT, 0666);
+                    direct_ = (fd_ >= 0);
+                }
+#endif
+                if (fd_ < 0)
+                    fd_ = ::open(path.c_str(), flags, 0666);
+                if (fd_ < 0)
+                    throw std::runtime_error("could not open download file");
+#if defined(F_NOCACHE) && !defined(O_DIRECT)
+                if (options.direct)
+                    ::fcntl(fd_, F_NOCACHE, 1);
+#endif
+
+                void* buffer = NULL;
+                if (::posix_memalign(&buffer, alignment, size_) != 0)
+                {
+                    ::close(fd_);
+                    throw std::bad_alloc();
+                }
+                buffer_ = static_cast<char*>(buffer);
+            }
+
+            ~file_writer()
+            {
+                if (fd_ >= 0)
+                    ::close(fd_);
+                free(buffer_);
+            }
+
+            // Reserve space for the expected number of bytes, from the
+            // Content-Length. Only a hint: the file's length still grows
+            // with what is actually written.
+            void reserve(off_t bytes)
+            {
+#ifdef __linux__
+                if (preallocate_ && bytes > 0)
+                    ::fallocate(fd_, FALLOC_FL_KEEP_SIZE, offset_, bytes);
+#else
+                (void)bytes;
+#endif
+            }
+
+            void write(const char* data, size_t size)
+            {
+                while (size > 0)
+                {
+                    size_t n = std::min(size, size_ - used_);
+                    memcpy(buffer_ + used_, data, n);
+                    used_ += n;
+                    data += n;
+                    size -= n;
+                    if (used_ == size_)
+                        flush();
+                }
+            }
+
+            // Write out whatever is left, and close the file
+            void close()
+            {
+                if (fd_ < 0)
+                    return;
+
+#ifdef O_DIRECT
+                size_t aligned = used_ / alignment * alignment;
+                if (direct_ && aligned < used_)
+                {
+                    // O_DIRECT can't write the ragged end
+                    write_at(fd_, buffer_, aligned, offset_);
+                    ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) & ~O_DIRECT);
+                    direct_ = false;
+                    write_at(fd_, buffer_ + aligned, used_ - aligned, offset_ + aligned);
+                    offset_ += used_;
+                    used_ = 0;
+                }
+#endif
+                if (used_ > 0)
+                    flush();
+                if (dropcache_)
+                    evict(offset_);
+
+                int fd = fd_;
+                fd_ = -1;
+                if (::close(fd) != 0)
+                    throw std::runtime_error("failed to write response body");
+            }
+
+        private:
+            void flush()
+            {
+                write_at(fd_, buffer_, used_, offset_);
+                off_t written = offset_;
+                offset_ += used_;
+                used_ = 0;
+
+                if (dropcache_)
+                    evict(written);
+            }
+
+            // Start writeback of the buffer just written, then wait for
+            // everything before it to reach the disk and drop it from the
+            // page cache. Waiting one buffer behind keeps the disk busy
+            // without blocking on the write just issued.
+            void evict(off_t written)
+            {
+#ifdef __linux__
+                ::sync_file_range(fd_, written, offset_ - written, SYNC_FILE_RANGE_WRITE);
+                if (written > flushed_)
+                {
+                    ::sync_file_range(fd_, flushed_, written - flushed_,
+                                      SYNC_FILE_RANGE_WAIT_BEFORE |
+                                      SYNC_FILE_RANGE_WRITE |
+                                      SYNC_FILE_RANGE_WAIT_AFTER);
+                }
+#endif
+#ifdef POSIX_FADV_DONTNEED
+                if (written > flushed_)
+                    ::posix_fadvise(fd_, flushed_, written - flushed_, POSIX_FADV_DONTNEED);
+#endif
+                flushed_ = written;
+            }
+
+            int fd_;
+            char* buffer_;
+            size_t size_;
+            size_t used_;
+            off_t offset_;      // Where the buffer goes in the file
+            off_t flushed_;     // Everything before here has been evicted
+            bool direct_;
+            bool dropcache_;
+            bool preallocate_;
+
+            // Noncopyable
+            file_writer(file_writer const&);
+            file_writer& operator=(file_writer const&);
+        };
+
+        // Body sink that writes to a file being downloaded
+        struct file_sink
+        {
+            explicit file_sink(file_writer* out)
+                : out(out)
+            { }
+
+            bool operator()(const char* data, size_t size) const
+            {
+                out->write(data, size);
+                return true;
+            }
+
+            file_writer* out;
+        };
+
+        //
+        // spill_buffer
+        //  Collects a body for getmapped: in a string up to the threshold,
+        //  then in a shared mapping of an unlinked temporary file, grown by
+        //  doubling (with mremap where there is one). release() trims the
+        //  file to the body and hands the bytes to a mappedbody, read-only.
+        //
+        class spill_buffer
+        {
+        public:
+            explicit spill_buffer(mapoptions const& options)
+                : options_(options), fd_(-1), map_(NULL), size_(0), capacity_(0)
+            { }
+
+            ~spill_buffer()
+            {
+                if (map_)
+                    munmap(map_, capacity_);
+                if (fd_ >= 0)
+                    ::close(fd_);
+            }
+
+            // Go straight to the mapping if the body is known to need it.
+            // Servers can claim anything, and a compressed body's length
+            // isn't its decoded size, so reserve no more than a cap up
+            // front; write() doubles from there.
+            void reserve(long long bytes)
+            {
+                static const long long limit = 256LL << 20;
+                if (!map_ && bytes > 0 && (unsigned long long)bytes > options_.threshold)
+                    spill(std::min(bytes, limit));
+            }
+
+            void write(const char* data, size_t size)
+            {
+                if (!map_ && heap_.size() + size > options_.threshold)
+                    spill(heap_.size() + size);
+                if (!map_)
+                {
+                    heap_.append(data, size);
+                    return;
+                }
+                if (size_ + size > capacity_)
+                    grow(std::max(size_ + size, capacity_ * 2));
+                memcpy(map_ + size_, data, size);
+                size_ += size;
+            }
+
+            mappedbody release()
+            {
+                std::shared_ptr<mappedbody::impl> storage = std::make_shared<mappedbody::impl>();
+                if (map_)
+                {
+                    // The pages past the end of the file are never read
+                    if (ftruncate(fd_, size_) != 0 ||
+                        mprotect(map_, capacity_, PROT_READ) != 0)
+                        throw std::runtime_error("could not map response body");
+                    storage->map = map_;
+                    storage->length = capacity_;
+                    map_ = NULL;
+                    ::close(fd_);
+                    fd_ = -1;
+                    return mappedbody::impl::make(storage, (const char*)storage->map, size_);
+                }
+
+                storage->heap.swap(heap_);
+                return mappedbody::impl::make(storage, storage->heap.data(), storage->heap.size());
+            }
+
+        private:
+            // Move what has been collected so far into a new mapping
+            void spill(size_t needed)
+            {
+                std::string path = options_.directory;
+                if (path.empty())
+                {
+                    const char* tmp = getenv("TMPDIR");
+                    path = (tmp && *tmp) ? tmp : "/tmp";
+                }
+                path += "/hurl-body-XXXXXX";
+                fd_ = mkstemp(&path[0]);
+                if (fd_ < 0)
+                    throw std::runtime_error("could not create file for response body");
+                unlink(path.c_str());
+
+                grow(std::max(needed, heap_.size() * 2));
+                memcpy(map_, heap_.data(), heap_.size());
+                size_ = heap_.size();
+                std::string().swap(heap_);
+            }
+
+            void grow(size_t capacity)
+            {
+                static const size_t page = sysconf(_SC_PAGESIZE);
+                capacity = (capacity + page - 1) / page * page;
+
+                // Reserve real blocks: a write to a hole in a full
+                // filesystem would raise SIGBUS, not an error
+                int error = EOPNOTSUPP;
+#ifdef __linux__
+                error = posix_fallocate(fd_, 0, capacity);
+#endif
+                if (error == EOPNOTSUPP && ftruncate(fd_, capacity) == 0)
+                    error = 0;
+                if (error != 0)
+                    throw std::runtime_error("could not grow file for response body");
+
+                void* map = MAP_FAILED;
+#ifdef MREMAP_MAYMOVE
+                if (map_)
+                    map = mremap(map_, capacity_, capacity, MREMAP_MAYMOVE);
+#endif
+                if (map == MAP_FAILED)
+                {
+                    // Map afresh; the file still holds what was written
+                    if (map_)
+                        munmap(map_, capacity_);
+                    map_ = NULL;
+                    map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+                    if (map == MAP_FAILED)
+                        throw std::runtime_error("could not map response body");
+                }
+                map_ = static_cast<char*>(map);
+                capacity_ = capacity;
+            }
+
+            mapoptions options_;
+            std::string heap_;
+            int fd_;
+            char* map_;
+            size_t size_;       // Bytes in the mapping
+            size_t capacity_;   // Length of the mapping and the file
+
+            // Noncopyable
+            spill_buffer(spill_buffer const&);
+            spill_buffer& operator=(spill_buffer const&);
+        };
+
+        struct spill_sink
+        {
+            explicit spill_sink(spill_buffer* out)
+                : out(out)
+            { }
+
+            bool operator()(const char* data, size_t size) const
+            {
+                out->write(data, size);
+                return true;
+            }
+
+            spill_buffer* out;
+        };
+
+        std::string gunzip(std::string const& input)
+        {
+            std::string result;
+
+            // A gzip member ends with ISIZE, the uncompressed length modulo
+            // 2^32, which makes a good first guess at the output size. It's
+            // only a hint, so don't trust it past deflate's maximum ratio.
+            if (input.size() >= 18)
+            {
+                const unsigned char* tail = (const unsigned char*)input.data() + input.size() - 4;
+                unsigned long isize = tail[0] | (tail[1] << 8) | (tail[2] << 16) |
+                                      ((unsigned long)tail[3] << 24);
+                result.reserve(std::min<unsigned long>(isize, 1032UL * input.size()));
+            }
+
+            inflater stream;
+            stream.write(input.data(), input.size(), string_sink(&result));
+            if (!stream.finished())
+                throw std::runtime_error("failed to completely inflate");
+            return result;
+        }
+
+        // Decode a whole body in the given Content-Encoding
+        std::string decode(std::string const& input, std::string const& encoding)
+        {
+            std::unique_ptr<decoder> stream = make_decoder(encoding);
+            if (!stream.get())
+                return input;
+
+            std::string result;
+            stream->write(input.data(), input.size(), string_sink(&result));
+            if (!stream->finished())
+                throw std::runtime_error("truncated " + encoding + " body");
+            return result;
+        }
+
+        extern "C" size_t headerfunc(void* ptr, size_t size, size_t nmemb, httpresponse* resp)
+        {
+            resp->headers.parseline(static_cast<const char*>(ptr), size * nmemb);
+            return size * nmemb;
+        }
+
+        // Reduce a URL to the scheme://host:port it will connect to
+        std::string pool_key(std::string const& url)
+        {
+            std::string scheme = "http";
+            size_t start = url.find("://");
+            if (start != std::string::npos)
+            {
+                scheme = tolower(url.substr(0, start));
+                start += 3;
+            }
+            else
+            {
+                start = 0;
+            }
+
+            size_t end = url.find_first_of("/?#", start);
+            std::string host = url.substr(start, end == std::string::npos ?
+                                                 std::string::npos : end - start);
+
+            // Drop any userinfo, then split off the port (minding IPv6 literals)
+            size_t at = host.rfind('@');
+            if (at != std::string::npos)
+                host.erase(0, at + 1);
+
+            std::string port;
+            size_t colon = host.rfind(':');
+            size_t bracket = host.rfind(']');
+            if (colon != std::string::npos &&
+                (bracket == std::string::npos || colon > bracket))
+            {
+                port = host.substr(colon + 1);
+                host.erase(colon);
+            }
+            if (port.empty())
+                port = (scheme == "https") ? "443" : "80";
+
+            return scheme + "://" + tolower(host) + ":" + port;
+        }
+
+        // The session cache shared by the free functions, if any
+        static std::atomic<CURLSH*> global_share(NULL);
+    }
+
+    //
+    // ratelimiter class implementation
+    //
+    //  The rate is a token bucket kept in one atomic: the time by which
+    //  the requests let through so far would have drained it, were each
+    //  to take its share of the rate in turn (GCRA's "theoretical arrival
+    //  time"). A request claims its turn with a compare-and-swap and
+    //  sleeps off whatever of it is more than burst turns ahead. Each host
+    //  has an atomic count of requests in flight; only requests that find
+    //  it full take the host's lock, to wait.
+    //
+    class ratelimiter::impl
+    {
+    public:
+        struct host
+        {
+            host()
+                : users(0), inflight(0), waiters(0)
+            { }
+
+            std::atomic<size_t> users;      // Requests holding or after a
+                                            // slot; see sweep
+            std::atomic<size_t> inflight;
+            std::atomic<int> waiters;
+            std::mutex mutex;
+            std::condition_variable vacancy;
+        };
+
+        // A limiter's insides, or NULL for no limiter
+        static impl* of(ratelimiter* limiter)
+        {
+            return limiter ? limiter->impl_.get() : NULL;
+        }
+
+        explicit impl(ratelimitoptions const& options)
+            : options_(options), interval_(0), tolerance_(0), due_(0), requests_(0),
+              throttled_(0), queued_(0), waited_(0), maxwait_(0), inflight_(0),
+              sweep_(64)
+        {
+            if (options.rate > 0)
+            {
+                interval_ = (long long)(1e9 / options.rate);
+                tolerance_ = (long long)((std::max(options.burst, 1.0) - 1) * interval_);
+            }
+        }
+
+        ratelimitoptions const& options() const
+        {
+            return options_;
+        }
+
+        // Wait for a slot at the host, and then a turn under the rate.
+        // Returns the host to hand back to leave(), if there is a limit.
+        // Throws hurl::timeout if that takes longer than timeout seconds
+        // (0 for no limit).
+        host* enter(std::string const& key, int timeout)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::chrono::steady_clock::time_point deadline =
+                start + std::chrono::seconds(timeout);
+            bool queued = false;
+            bool throttled = false;
+
+            host* h = NULL;
+            if (options_.maxperhost > 0)
+            {
+                h = find(key);
+                if (!claim(h))
+                {
+                    std::unique_lock<std::mutex> lock(h->mutex);
+                    ++h->waiters;
+                    bool late = false;
+                    while (!claim(h))
+                    {
+                        if (late)
+                        {
+                            --h->waiters;
+                            lock.unlock();
+                            drop(h);
+                            throw hurl::timeout();
+                        }
+                        if (timeout > 0)
+                            late = h->vacancy.wait_until(lock, deadline) ==
+                                   std::cv_status::timeout;
+                        else
+                            h->vacancy.wait(lock);
+                    }
+                    --h->waiters;
+                    queued = true;
+                }
+            }
+
+            if (interval_ > 0)
+            {
+                long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+                long long due = due_.load();
+                long long turn;
+                do
+                {
+                    turn = std::max(due, now);
+                }
+                while (!due_.compare_exchange_weak(due, turn + interval_));
+
+                long long wait = turn - tolerance_ - now;
+                if (wait > 0)
+                {
+                    if (timeout > 0 && std::chrono::steady_clock::now() +
+                                           std::chrono::nanoseconds(wait) > deadline)
+                    {
+                        // Hand the turn back if no one has queued behind it
+                        long long next = turn + interval_;
+                        due_.compare_exchange_strong(next, turn);
+                        vacate(h);
+                        throw hurl::timeout();
+                    }
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+                    throttled = true;
+                }
+            }
+
+            ++requests_;
+            ++inflight_;
+            if (queued || throttled)
+            {
+                long long waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+                waited_ += waited;
+                long long longest = maxwait_.load();
+                while (waited > longest && !maxwait_.compare_exchange_weak(longest, waited))
+                    ;
+                if (queued)
+                    ++queued_;
+                if (throttled)
+                    ++throttled_;
+            }
+            return h;
+        }
+
+        void leave(host* h)
+        {
+            --inflight_;
+            vacate(h);
+        }
+
+        ratestats stats() const
+        {
+            ratestats result;
+            result.requests = requests_.load();
+            result.throttled = throttled_.load();
+            result.queued = queued_.load();
+            result.waited = waited_.load() / 1e9;
+            result.maxwait = maxwait_.load() / 1e9;
+            result.inflight = inflight_.load();
+            return result;
+        }
+
+    private:
+        typedef std::map<std::string, std::unique_ptr<host> > hostmap;
+
+        // The counter for requests in flight to a host, made on first use
+        host* find(std::string const& key)
+        {
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex_);
+                hostmap::iterator it = hosts_.find(key);
+                if (it != hosts_.end())
+                {
+                    ++it->second->users;
+                    return it->second.get();
+                }
+            }
+
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            if (hosts_.size() >= sweep_)
+                sweep();
+            std::unique_ptr<host>& h = hosts_[key];
+            if (!h)
+                h.reset(new host());
+            ++h->users;
+            return h.get();
+        }
+
+        // Let go of a host found above
+        void drop(host* h)
+        {
+            --h->users;
+        }
+
+        // Forget the hosts no request holds or waits for a slot at, once
+        // the map has doubled since the last sweep. Users are only added
+        // under the lock, which the caller holds exclusively, so a host
+        // with none can't gain one while it goes.
+        void sweep()
+        {
+            hostmap::iterator it = hosts_.begin();
+            while (it != hosts_.end())
+            {
+                if (it->second->users.load() == 0)
+                    hosts_.erase(it++);
+                else
+                    ++it;
+            }
+            sweep_ = std::max<size_t>(64, hosts_.size() * 2);
+        }
+
+        // Give back a slot at a host, if there is a limit
+        void vacate(host* h)
+        {
+            if (h == NULL)
+                return;
+            h->inflight.fetch_sub(1);
+            // A waiter counts itself before trying for a slot, so it either
+            // sees this one free or is waiting by the time we notify
+            if (h->waiters.load() > 0)
+            {
+                std::lock_guard<std::mutex> lock(h->mutex);
+                h->vacancy.notify_one();
+            }
+            drop(h);
+        }
+
+        bool claim(host* h)
+        {
+            size_t n = h->inflight.load();
+            while (n < options_.maxperhost)
+            {
+                if (h->inflight.compare_exchange_weak(n, n + 1))
+                    return true;
+            }
+            return false;
+        }
+
+        ratelimitoptions options_;
+        long long interval_;                // Nanoseconds per request
+        long long tolerance_;               // How far ahead a turn may be
+                                            // and still start at once
+        std::atomic<long long> due_;        // See above, in steady_clock ns
+        std::atomic<long long> requests_;
+        std::atomic<long long> throttled_;
+        std::atomic<long long> queued_;
+        std::atomic<long long> waited_;     // Nanoseconds
+        std::atomic<long long> maxwait_;    // Nanoseconds
+        std::atomic<long long> inflight_;
+        std::shared_mutex mutex_;           // Shared to look up a host,
+                                            // exclusive to add or sweep
+        hostmap hosts_;
+        size_t sweep_;                      // Size of hosts_ to sweep at
+    };
+
+    ratelimiter::ratelimiter(ratelimitoptions const& options)
+        : impl_(new impl(options))
+    {
+    }
+
+    ratelimiter::~ratelimiter()
+    {
+    }
+
+    ratestats ratelimiter::stats() const
+    {
+        return impl_->stats();
+    }
+
+    namespace detail
+    {
+        // Installed by setratelimiter
+        static std::atomic<ratelimiter*> global_limiter(NULL);
+
+        //
+        // admission
+        //  A request's passage through a ratelimiter: waits, if need be,
+        //  for a slot at its host and its turn under the rate, and gives
+        //  the slot back on destruction. Does nothing without a limiter.
+        //  Throws hurl::timeout if the wait outlasts timeout seconds.
+        //
+        class admission
+        {
+        public:
+            admission(ratelimiter* limiter, std::string const& key, int timeout)
+                : limiter_(ratelimiter::impl::of(limiter)), host_(NULL)
+            {
+                if (limiter_)
+                    host_ = limiter_->enter(key, timeout);
+            }
+
+            ~admission()
+            {
+                if (limiter_)
+                    limiter_->leave(host_);
+            }
+
+            // Apply the limiter's speed caps to a handle, or clear them
+            void throttle(handle& curl) const
+            {
+                if (limiter_)
+                    curl.throttle(limiter_->options().maxrecvspeed,
+                                  limiter_->options().maxsendspeed);
+                else
+                    curl.throttle(0, 0);
+            }
+
+        private:
+            ratelimiter::impl* limiter_;
+            ratelimiter::impl::host* host_;
+
+            // Noncopyable
+            admission(admission const&);
+            admission& operator=(admission const&);
+        };
+
+        //
+        // pooled_handle
+        //  Borrows a handle from the process-wide pool for the lifetime of
+        //  this object and hands it back on destruction. The handle joins
+        //  the global session cache, if one is set. Unless paced is false,
+        //  the request it is borrowed for first passes the global rate
+        //  limiter, waiting no longer than its timeout; an unpaced handle
+        //  has no speed caps.
+        //
+        class pooled_handle
+        {
+        public:
+            pooled_handle(std::string const& url, int timeout, bool paced = true)
+                : key_(pool_key(url)),
+                  admit_(paced ? global_limiter.load() : NULL, key_, timeout),
+                  curl_(pool.acquire(key_))
+            {
+                try
+                {
+                    curl_->share(global_share.load());
+                    admit_.throttle(*curl_);
+                }
+                catch (...)
+                {
+                    pool.release(key_, curl_);
+                    throw;
+                }
+            }
+
+            ~pooled_handle()
+            {
+                pool.release(key_, curl_);
+            }
+
+            handle& operator*()
+            {
+                return *curl_;
+            }
+
+        private:
+            std::string key_;
+            admission admit_;
+            handle* curl_;
+
+            // Noncopyable
+            pooled_handle(pooled_handle const&);
+            pooled_handle& operator=(pooled_handle const&);
+        };
+
+        //
+        // receiver
+        //  The target of curl's write callback. Decodes the body on the fly
+        //  when the response headers call for it and hands each chunk to a
+        //  sink: the response buffer, a file, or the caller's own. Exceptions
+        //  can't propagate through libcurl, so any raised here are held
+        //  until the transfer ends and rethrown by settle().
+        //
+        struct receiver
+        {
+            explicit receiver(httpresponse& resp)
+                : resp(&resp), buffer(NULL), file(NULL), spill(NULL), started(false),
+                  aborted(false)
+            { }
+
+            httpresponse* resp;
+            bodysink sink;
+            std::string* buffer;    // Set while sink collects into a string
+            file_writer* file;      // Set while sink writes to a file
+            spill_buffer* spill;    // Set while sink collects for getmapped
+            std::unique_ptr<detail::decoder> decoder;
+            bool started;
+            bool aborted;
+            std::exception_ptr error;
+        };
+
+        // Make room for a body from its Content-Length: exact for identity
+        // responses, and a lower bound for compressed ones. Servers can
+        // claim anything, so don't take their word for more than a cap.
+        void presize(std::string& buffer, std::string_view length)
+        {
+            static const unsigned long long limit = 256ULL << 20;
+            unsigned long long size = 0;
+            for (size_t i = 0; i < length.size() && isdigit((unsigned char)length[i]); ++i)
+                size = std::min(size * 10 + (length[i] - '0'), limit);
+            buffer.reserve(buffer.size() + size);
+        }
+
+        extern "C" size_t sinkfunc(void* ptr, size_t size, size_t nmemb, receiver* r)
+        {
+            try
+            {
+                // All headers have arrived by the time the body starts
+                if (!r->started)
+                {
+                    r->started = true;
+                    r->decoder = make_decoder(r->resp->headers.get("content-encoding"));
+                    std::string_view length = r->resp->headers.get("content-length");
+                    if (r->buffer)
+                        presize(*r->buffer, length);
+                    if (r->file && !length.empty())
+                        r->file->reserve(strtoll(std::string(length).c_str(), NULL, 10));
+                    if (r->spill && !length.empty())
+                        r->spill->reserve(strtoll(std::string(length).c_str(), NULL, 10));
+                }
+
+                const char* data = static_cast<const char*>(ptr);
+                bool more = r->decoder.get() ? r->decoder->write(data, size * nmemb, r->sink)
+                                             : r->sink(data, size * nmemb);
+                if (!more)
+                {
+                    r->aborted = true;
+                    return 0;
+                }
+            }
+            catch (...)
+            {
+                r->error = std::current_exception();
+                return 0;
+            }
+            return size * nmemb;
+        }
+
+        //
+        // sender
+        //  The target of curl's read callback, for request bodies that are
+        //  streamed rather than held in memory: pulls them from a source,
+        //  gzipping them on the way if asked. Exceptions are held for
+        //  settle(), as with receiver.
+        //
+        struct sender
+        {
+            bodysource source;
+            std::unique_ptr<deflater> encoder;
+            std::exception_ptr error;
+        };
+
+        extern "C" size_t readfunc(char* buffer, size_t size, size_t nitems, sender* s)
+        {
+            try
+            {
+                return s->encoder.get() ? s->encoder->read(s->source, buffer, size * nitems)
+                                        : s->source(buffer, size * nitems);
+            }
+            catch (...)
+            {
+                s->error = std::current_exception();
+                return CURL_READFUNC_ABORT;
+            }
+        }
+
+        //
+        // Percent-encoding
+        //  Runs of unreserved characters are copied through whole, found a
+        //  16 bytes at a time with SSE2 where there is any, and a table
+        //  otherwise; everything else becomes %XX. A form is measured first
+        //  and then written straight into its string, without temporaries.
+        //
+
+        // The unreserved characters of RFC 3986: ALPHA DIGIT - . _ ~
+        static const bool unreserved[256] = {
+            0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+            0,0,0,0,0,0,0,0, 0,0,0,0,0,1,1,0, 1,1,1,1,1,1,1,1, 1,1,0,0,0,0,0,0,
+            0,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,0,0,0,0,1,
+            0,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,0,0,0,1,0
+        };
+
+        // The length of the run of unreserved characters at the start of s
+        size_t unreserved_run(const char* s, size_t size)
+        {
+            size_t i = 0;
+#if defined(__SSE2__)
+            // Bytes from 0x80 up are negative, and so outside every range
+            const __m128i below_a = _mm_set1_epi8('a' - 1);
+            const __m128i above_z = _mm_set1_epi8('z' + 1);
+            const __m128i below_0 = _mm_set1_epi8('0' - 1);
+            const __m128i above_9 = _mm_set1_epi8('9' + 1);
+            const __m128i case_bit = _mm_set1_epi8(0x20);
+            const __m128i dash = _mm_set1_epi8('-');
+            const __m128i dot = _mm_set1_epi8('.');
+            const __m128i underscore = _mm_set1_epi8('_');
+            const __m128i tilde = _mm_set1_epi8('~');
+            for (; i + 16 <= size; i += 16)
+            {
+                __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+
+                // Setting 0x20 folds exactly A-Z onto a-z
+                __m128i folded = _mm_or_si128(c, case_bit);
+                __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(folded, below_a),
+                                           _mm_cmplt_epi8(folded, above_z));
+                ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(c, below_0),
+                                                    _mm_cmplt_epi8(c, above_9)));
+                ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(c, dash),
+                                                   _mm_cmpeq_epi8(c, dot)));
+                ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(c, underscore),
+                                                   _mm_cmpeq_epi8(c, tilde)));
+
+                unsigned mask = _mm_movemask_epi8(ok);
+                if (mask != 0xffff)
+                    return i + __builtin_ctz(~mask);
+            }
+#endif
+            while (i < size && unreserved[(unsigned char)s[i]])
+                ++i;
+            return i;
+        }
+
+        size_t escaped_size(std::string_view value)
+        {
+            size_t size = value.size();
+            for (size_t i = 0; i < value.size(); ++i)
+            {
+                i += unreserved_run(value.data() + i, value.size() - i);
+                if (i < value.size())
+                    size += 2;
+            }
+            return size;
+        }
+
+        // Write value percent-encoded at out, returning the end
+        char* escape(std::string_view value, char* out)
+        {
+            static const char hex[] = "0123456789ABCDEF";
+            size_t i = 0;
+            while (i < value.size())
+            {
+                size_t run = unreserved_run(value.data() + i, value.size() - i);
+                memcpy(out, value.data() + i, run);
+                out += run;
+                i += run;
+                if (i < value.size())
+                {
+                    unsigned char c = value[i++];
+                    *out++ = '%';
+                    *out++ = hex[c >> 4];
+                    *out++ = hex[c & 15];
+                }
+            }
+            return out;
+        }
+
+        // The length of params as a form: name=value pairs joined by '&'.
+        // Params is any container of pairs of strings or string_views.
+        template<typename Params>
+        size_t form_size(Params const& params)
+        {
+            size_t size = 0;
+            for (typename Params::const_iterator it = params.begin(); it != params.end(); ++it)
+                size += escaped_size(it->first) + escaped_size(it->second) + 2;
+            return params.empty() ? 0 : size - 1;
+        }
+
+        // Write params as a form at out, in the container's order
+        template<typename Params>
+        void write_form(Params const& params, char* out)
+        {
+            for (typename Params::const_iterator it = params.begin(); it != params.end(); ++it)
+            {
+                if (it != params.begin())
+                    *out++ = '&';
+                out = escape(it->first, out);
+                *out++ = '=';
+                out = escape(it->second, out);
+            }
+        }
+
+        template<typename Params>
+        std::string form(Params const& params)
+        {
+            std::string result(form_size(params), '\0');
+            write_form(params, &result[0]);
+            return result;
+        }
+
+        // Serialize HTTP params in a URL-encoded form appropriate for a
+        // query string or POST-fields request body.
+        std::string serialize(httpparams const& params)
+        {
+            return form(params);
+        }
+
+        std::string query(std::string const& url, httpparams const& params)
+        {
+            std::string result(url.size() + 1 + form_size(params), '?');
+            memcpy(&result[0], url.data(), url.size());
+            write_form(params, &result[url.size() + 1]);
+            return result;
+        }
+
+
+        //
+        // Response caching
+        //  Entries are immutable once made and handed around by shared_ptr,
+        //  so a request can go on using one after it has been evicted or
+        //  replaced; a revalidated entry is replaced by a copy that shares
+        //  the old body.
+        //
+        struct cacheentry
+        {
+            std::string url;
+            int status;
+            headerlist headers;
+            std::shared_ptr<const std::string> body;
+            time_t expires;     // When it goes stale, by the local clock
+            bool revalidate;    // no-cache: never serve it without asking
+            size_t bytes;       // Roughly the memory it holds
+        };
+
+        struct cachecontrol
+        {
+            cachecontrol()
+                : nostore(false), nocache(false), maxage(-1)
+            { }
+
+            bool nostore;
+            bool nocache;
+            long maxage;
+        };
+
+        std::string_view trim(std::string_view s)
+        {
+            while (!s.empty() && is_space(s.front()))
+                s.remove_prefix(1);
+            while (!s.empty() && is_space(s.back()))
+                s.remove_suffix(1);
+            return s;
+        }
+
+        // Calls f with each element of a comma-separated header value
+        template<typename F>
+        void each_token(std::string_view value, F f)
+        {
+            while (!value.empty())
+            {
+                size_t comma = value.find(',');
+                f(trim(value.substr(0, comma)));
+                if (comma == std::string_view::npos)
+                    break;
+                value.remove_prefix(comma + 1);
+            }
+        }
+
+        struct parse_directive
+        {
+            explicit parse_directive(cachecontrol& cc)
+                : cc(cc)
+            { }
+
+            void operator()(std::string_view token) const
+            {
+                size_t eq = token.find('=');
+                std::string_view name = trim(token.substr(0, eq));
+                if (iequals(name, "no-store"))
+                    cc.nostore = true;
+                else if (iequals(name, "no-cache"))
+                    cc.nocache = true;
+                else if (iequals(name, "max-age") && eq != std::string_view::npos)
+                {
+                    std::string value(trim(token.substr(eq + 1)));
+                    if (!value.empty() && value[0] == '"')
+                        value.erase(0, 1);
+                    cc.maxage = std::max(0L, atol(value.c_str()));
+                }
+            }
+
+            cachecontrol& cc;
+        };
+
+        cachecontrol parse_cachecontrol(headerlist const& headers)
+        {
+            cachecontrol cc;
+            std::vector<std::string_view> values = headers.getall("cache-control");
+            for (size_t i = 0; i < values.size(); ++i)
+                each_token(values[i], parse_directive(cc));
+
+            // HTTP/1.0 servers say no-cache with Pragma
+            if (values.empty() && iequals(trim(headers.get("pragma")), "no-cache"))
+                cc.nocache = true;
+            return cc;
+        }
+
+        // An HTTP date as a time_t, or -1 if it is missing or malformed
+        time_t httpdate(std::string_view value)
+        {
+            if (value.empty())
+                return -1;
+            return curl_getdate(std::string(value).c_str(), NULL);
+        }
+
+        struct vary_check
+        {
+            explicit vary_check(bool& other)
+                : other(other)
+            { }
+
+            void operator()(std::string_view token) const
+            {
+                if (!token.empty() && !iequals(token, "accept-encoding"))
+                    other = true;
+            }
+
+            bool& other;
+        };
+
+        // Whether a response depends on request headers other than the
+        // Accept-Encoding, which hurl always sends the same
+        bool varies(headerlist const& headers)
+        {
+            bool other = false;
+            std::vector<std::string_view> values = headers.getall("vary");
+            for (size_t i = 0; i < values.size(); ++i)
+                each_token(values[i], vary_check(other));
+            return other;
+        }
+
+        // When a response received at the given time goes stale, following
+        // RFC 9111 section 4.2 (but for the response delay). A response
+        // without any freshness information is stale straight away.
+        time_t expiry(headerlist const& headers, cachecontrol const& cc, time_t now)
+        {
+            time_t date = httpdate(headers.get("date"));
+            if (date < 0)
+                date = now;
+            long age = atol(std::string(headers.get("age")).c_str());
+            long current = std::max<long>(std::max<long>(now - date, 0), age);
+
+            long lifetime = 0;
+            if (cc.maxage >= 0)
+                lifetime = cc.maxage;
+            else if (headers.count("expires"))
+            {
+                // A malformed Expires means already expired
+                time_t expires = httpdate(headers.get("expires"));
+                lifetime = (expires < 0) ? 0 : std::max<long>(expires - date, 0);
+            }
+            else
+            {
+                // Heuristic freshness: a tenth of the time since the last
+                // change, up to a day
+                time_t modified = httpdate(headers.get("last-modified"));
+                if (modified >= 0 && modified < date)
+                    lifetime = std::min<long>((date - modified) / 10, 86400);
+            }
+            return now - current + lifetime;
+        }
+
+        bool cacheable_status(int status)
+        {
+            switch (status)
+            {
+            case 200: case 203: case 204: case 300: case 301: case 308:
+            case 404: case 405: case 410: case 414: case 501:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        std::shared_ptr<cacheentry> build_entry(std::string const&  url,
+                                                int                 status,
+                                                headerlist const&   headers,
+                                                std::shared_ptr<const std::string> const& body,
+                                                time_t              expires,
+                                                bool                revalidate)
+        {
+            std::shared_ptr<cacheentry> e(new cacheentry);
+            e->url = url;
+            e->status = status;
+            e->headers = headers;
+            e->body = body;
+            e->expires = expires;
+            e->revalidate = revalidate;
+            e->bytes = sizeof(cacheentry) + url.size() + body->size();
+            for (headerlist::const_iterator it = headers.begin(); it != headers.end(); ++it)
+                e->bytes += (*it).first.size() + (*it).second.size();
+            return e;
+        }
+
+        // Whether a response should be kept, and if so until when, and
+        // whether it must be revalidated before every use
+        bool storable(int                   status,
+                      headerlist const&     headers,
+                      time_t                now,
+                      time_t&               expires,
+                      bool&                 revalidate)
+        {
+            cachecontrol cc = parse_cachecontrol(headers);
+            if (!cacheable_status(status) || cc.nostore || varies(headers))
+                return false;
+
+            expires = expiry(headers, cc, now);
+            revalidate = cc.nocache;
+            bool validators = headers.count("etag") || headers.count("last-modified");
+            return expires > now || validators;
+        }
+
+        // An entry for a response, or NULL if it mustn't or needn't be kept
+        std::shared_ptr<cacheentry> make_entry(std::string const&   url,
+                                               int                  status,
+                                               headerlist const&    headers,
+                                               std::shared_ptr<const std::string> const& body,
+                                               time_t               now)
+        {
+            time_t expires;
+            bool revalidate;
+            if (!storable(status, headers, now, expires, revalidate))
+                return std::shared_ptr<cacheentry>();
+            return build_entry(url, status, headers, body, expires, revalidate);
+        }
+
+        //
+        // cachedir
+        //  The disk tier of a responsecache: one file per entry, named after
+        //  a hash of its URL, which is stored inside to catch collisions.
+        //  Files are written aside and renamed into place, so readers never
+        //  see half an entry. An index of file sizes in order of use is kept
+        //  in memory, built from the files' modification times at startup.
+        //  Not thread-safe; the cache locks around it.
+        //
+        class cachedir
+        {
+        public:
+            cachedir(std::string const& path, size_t maxbytes)
+                : path_(path), max_(maxbytes), bytes_(0), evictions_(0)
+            {
+                ::mkdir(path.c_str(), 0755);
+                DIR* dir = ::opendir(path.c_str());
+                if (dir == NULL)
+                    throw std::runtime_error("cannot open cache directory " + path);
+
+                std::vector<std::pair<time_t, std::string> > found;
+                while (dirent* d = ::readdir(dir))
+                {
+                    std::string name(d->d_name);
+                    struct stat st;
+                    if (name.size() > suffix().size() &&
+                        name.compare(name.size() - suffix().size(), std::string::npos, suffix()) == 0 &&
+                        ::stat((path_ + "/" + name).c_str(), &st) == 0)
+                    {
+                        found.push_back(std::make_pair(st.st_mtime, name));
+                        sizes_[name] = st.st_size;
+                    }
+                }
+                ::closedir(dir);
+
+                // Oldest first, so the newest end up at the front
+                std::sort(found.begin(), found.end());
+                for (size_t i = 0; i < found.size(); ++i)
+                    touch(found[i].second, sizes_[found[i].second]);
+                shrink();
+            }
+
+            std::shared_ptr<cacheentry> load(std::string const& url)
+            {
+                std::string name = filename(url);
+                if (!index_.count(name))
+                    return std::shared_ptr<cacheentry>();
+
+                std::ifstream in((path_ + "/" + name).c_str(), std::ios::in | std::ios::binary);
+                std::string magic, key, line;
+                std::getline(in, magic);
+                std::getline(in, key);
+                if (magic != "hurl-cache 1" || key != url)
+                    return std::shared_ptr<cacheentry>();
+
+                int status = 0;
+                long long expires = 0;
+                int revalidate = 0;
+                size_t count = 0;
+                in >> status >> expires >> revalidate >> count;
+                std::getline(in, line);
+
+                headerlist headers;
+                for (size_t i = 0; i < count && std::getline(in, line); ++i)
+                {
+                    size_t colon = line.find(':');
+                    if (colon != std::string::npos)
+                        headers.add(std::string_view(line).substr(0, colon),
+                                    trim(std::string_view(line).substr(colon + 1)));
+                }
+
+                size_t length = 0;
+                in >> length;
+                std::getline(in, line);
+                std::shared_ptr<std::string> body(new std::string(length, '\0'));
+                if (!in.read(&(*body)[0], length))
+                {
+                    erase(name);
+                    return std::shared_ptr<cacheentry>();
+                }
+
+                touch(name, sizes_[name]);
+                return build_entry(url, status, headers, body, expires, revalidate != 0);
+            }
+
+            // Best effort: a full disk just means a smaller cache
+            void save(cacheentry const& e)
+            {
+                std::string name = filename(e.url);
+                std::string path = path_ + "/" + name;
+                // A temporary of its own, so that caches in other processes
+                // saving the same URL can't interleave their writes with ours
+                std::string temp = path + ".XXXXXX";
+                int fd = mkstemp(&temp[0]);
+                if (fd < 0)
+                    return;
+                ::close(fd);
+                {
+                    std::ofstream out(temp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+                    out << "hurl-cache 1\n" << e.url << "\n"
+                        << e.status << " " << (long long)e.expires << " "
+                        << (e.revalidate ? 1 : 0) << " " << e.headers.size() << "\n";
+                    for (headerlist::const_iterator it = e.headers.begin(); it != e.headers.end(); ++it)
+                        out << (*it).first << ": " << (*it).second << "\n";
+                    out << e.body->size() << "\n";
+                    out.write(e.body->data(), e.body->size());
+                    if (!out.flush())
+                    {
+                        ::unlink(temp.c_str());
+                        return;
+                    }
+                }
+
+                struct stat st;
+                if (::rename(temp.c_str(), path.c_str()) != 0 || ::stat(path.c_str(), &st) != 0)
+                {
+                    ::unlink(temp.c_str());
+                    return;
+                }
+                touch(name, st.st_size);
+                shrink();
+            }
+
+            void clear()
+            {
+                while (!lru_.empty())
+                    erase(lru_.back());
+            }
+
+            size_t bytes() const { return bytes_; }
+            long long evictions() const { return evictions_; }
+
+        private:
+            static std::string const& suffix()
+            {
+                static const std::string s(".hurl-cache");
+                return s;
+            }
+
+            // FNV-1a, which is plenty to spread URLs over file names
+            static std::string filename(std::string const& url)
+            {
+                unsigned long long hash = 14695981039346656037ULL;
+                for (size_t i = 0; i < url.size(); ++i)
+                {
+                    hash ^= (unsigned char)url[i];
+                    hash *= 1099511628211ULL;
+                }
+                char name[32];
+                snprintf(name, sizeof(name), "%016llx", hash);
+                return name + suffix();
+            }
+
+            // Record a file as the most recently used
+            void touch(std::string const& name, size_t size)
+            {
+                std::map<std::string, std::list<std::string>::iterator>::iterator it = index_.find(name);
+                if (it != index_.end())
+                {
+                    bytes_ -= sizes_[name];
+                    lru_.erase(it->second);
+                }
+                lru_.push_front(name);
+                index_[name] = lru_.begin();
+                sizes_[name] = size;
+                bytes_ += size;
+            }
+
+            // By value: callers pass names that live in lru_
+            void erase(std::string name)
+            {
+                ::unlink((path_ + "/" + name).c_str());
+                std::map<std::string, std::list<std::string>::iterator>::iterator it = index_.find(name);
+                if (it != index_.end())
+                {
+                    bytes_ -= sizes_[name];
+                    lru_.erase(it->second);
+                    index_.erase(it);
+                }
+                sizes_.erase(name);
+            }
+
+            void shrink()
+            {
+                while (bytes_ > max_ && !lru_.empty())
+                {
+                    erase(lru_.back());
+                    ++evictions_;
+                }
+            }
+
+            std::string path_;
+            size_t max_;
+            size_t bytes_;
+            long long evictions_;
+            std::list<std::string> lru_;
+            std::map<std::string, std::list<std::string>::iterator> index_;
+            std::map<std::string, size_t> sizes_;
+        };
+    }
+
+    //
+    // responsecache class implementation
+    //
+    //  The memory tier is a list in order of use with a map over it, under
+    //  one lock; the disk tier has a lock of its own, so that file I/O
+    //  doesn't hold up lookups in memory.
+    //
+    class responsecache::impl
+    {
+    public:
+        typedef std::shared_ptr<const detail::cacheentry> entry;
+
+        // A cache's insides, or NULL for no cache
+        static impl* of(responsecache* cache)
+        {
+            return cache ? cache->impl_.get() : NULL;
+        }
+
+        impl(size_t maxbytes, std::string const& directory, size_t maxdiskbytes)
+            : max_(maxbytes)
+        {
+            if (!directory.empty())
+                disk_.reset(new detail::cachedir(directory, maxdiskbytes));
+        }
+
+        entry find(std::string const& url)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::map<std::string, std::list<entry>::iterator>::iterator it = index_.find(url);
+                if (it != index_.end())
+                {
+                    lru_.splice(lru_.begin(), lru_, it->second);
+                    return *it->second;
+                }
+            }
+            if (!disk_)
+                return entry();
+
+            entry e;
+            {
+                std::lock_guard<std::mutex> lock(diskmutex_);
+                e = disk_->load(url);
+            }
+            if (e)
+            {
+                keep(e);
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++stats_.diskhits;
+            }
+            return e;
+        }
+
+        void store(entry const& e)
+        {
+            keep(e);
+            if (disk_)
+            {
+                std::lock_guard<std::mutex> lock(diskmutex_);
+                disk_->save(*e);
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.stores;
+        }
+
+        void hit(size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.hits;
+            stats_.bytessaved += bytes;
+        }
+
+        void revalidated(size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.revalidated;
+            stats_.bytessaved += bytes;
+        }
+
+        void missed()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.misses;
+        }
+
+        cachestats stats() const
+        {
+            cachestats result;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                result = stats_;
+                result.entries = lru_.size();
+            }
+            if (disk_)
+            {
+                std::lock_guard<std::mutex> lock(diskmutex_);
+                result.diskbytes = disk_->bytes();
+                result.diskevictions = disk_->evictions();
+            }
+            return result;
+        }
+
+        void clear()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                lru_.clear();
+                index_.clear();
+                stats_.bytes = 0;
+            }
+            if (disk_)
+            {
+                std::lock_guard<std::mutex> lock(diskmutex_);
+                disk_->clear();
+            }
+        }
+
+    private:
+        // Put an entry in the memory tier, evicting others to make room
+        void keep(entry const& e)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            drop(e->url);
+            if (e->bytes > max_)
+                return;
+
+            lru_.push_front(e);
+            index_[e->url] = lru_.begin();
+            stats_.bytes += e->bytes;
+            while (stats_.bytes > max_)
+            {
+                entry victim = lru_.back();
+                drop(victim->url);
+                ++stats_.evictions;
+            }
+        }
+
+        // Requires mutex_
+        void drop(std::string const& url)
+        {
+            std::map<std::string, std::list<entry>::iterator>::iterator it = index_.find(url);
+            if (it == index_.end())
+                return;
+            stats_.bytes -= (*it->second)->bytes;
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+
+        size_t max_;
+        mutable std::mutex mutex_;
+        std::list<entry> lru_;
+        std::map<std::string, std::list<entry>::iterator> index_;
+        cachestats stats_;
+
+        std::unique_ptr<detail::cachedir> disk_;
+        mutable std::mutex diskmutex_;
+    };
+
+    namespace detail
+    {
+        //
+        // cached_request
+        //  Takes one GET through a responsecache (or none, when given NULL):
+        //  serves it from a fresh entry, or makes a stale entry's request
+        //  conditional and turns a 304 into the entry, or else stores the
+        //  new response.
+        //
+        class cached_request
+        {
+        public:
+            cached_request(responsecache* cache, std::string const& url)
+                : cache_(responsecache::impl::of(cache)), url_(url)
+            {
+            }
+
+            // Fill in the response from a fresh entry, if there is one
+            bool fresh(httpresponse& into)
+            {
+                if (cache_ == NULL)
+                    return false;
+                entry_ = cache_->find(url_);
+                if (!entry_ || entry_->revalidate || time(NULL) >= entry_->expires)
+                    return false;
+
+                copy(*entry_, into);
+                into.stats = httpstats();
+                into.stats.cached = true;
+                cache_->hit(entry_->body->size());
+                return true;
+            }
+
+            // Ask the server to confirm a stale entry rather than resend it
+            void condition(handle& curl) const
+            {
+                if (!entry_)
+                    return;
+                std::string_view etag = entry_->headers.get("etag");
+                if (!etag.empty())
+                    curl.add_header("If-None-Match: " + std::string(etag));
+                std::string_view modified = entry_->headers.get("last-modified");
+                if (!modified.empty())
+                    curl.add_header("If-Modified-Since: " + std::string(modified));
+            }
+
+            void complete(httpresponse& result) const
+            {
+                if (cache_ == NULL)
+                    return;
+                time_t now = time(NULL);
+
+                if (result.status == 304 && entry_)
+                {
+                    // The 304's headers update the stored ones, except
+                    // those that describe the body (RFC 9111 section 3.2)
+                    headerlist merged;
+                    for (headerlist::const_iterator it = entry_->headers.begin();
+                         it != entry_->headers.end(); ++it)
+                    {
+                        if (describes_body((*it).first) || !result.headers.count((*it).first))
+                            merged.add((*it).first, (*it).second);
+                    }
+                    for (headerlist::const_iterator it = result.headers.begin();
+                         it != result.headers.end(); ++it)
+                    {
+                        if (!describes_body((*it).first))
+                            merged.add((*it).first, (*it).second);
+                    }
+
+                    std::shared_ptr<cacheentry> refreshed =
+                        make_entry(url_, entry_->status, merged, entry_->body, now);
+                    if (refreshed)
+                        cache_->store(refreshed);
+
+                    httpstats stats = result.stats;
+                    copy(refreshed ? *refreshed : *entry_, result);
+                    result.stats = stats;
+                    result.stats.cached = true;
+                    cache_->revalidated(entry_->body->size());
+                    return;
+                }
+
+                // Only copy the body for a response that will be kept
+                cache_->missed();
+                time_t expires;
+                bool revalidate;
+                if (!storable(result.status, result.headers, now, expires, revalidate))
+                    return;
+                std::shared_ptr<const std::string> body(new std::string(result.body));
+                cache_->store(build_entry(url_, result.status, result.headers, body,
+                                          expires, revalidate));
+            }
+
+        private:
+            static bool describes_body(std::string_view name)
+            {
+                return name == "content-length" || name == "content-encoding" ||
+                       name == "transfer-encoding";
+            }
+
+            static void copy(cacheentry const& e, httpresponse& into)
+            {
+                into.status = e.status;
+                into.headers = e.headers;
+                into.body.assign(*e.body);
+            }
+
+            responsecache::impl* cache_;
+            std::string url_;
+            responsecache::impl::entry entry_;
+        };
+
+        //
+        // transfer
+        //  The state a request needs while curl is working on it: the
+        //  response being filled in, where the body goes, and any POST data
+        //  curl points into or reads from. Blocking requests keep one on the
+        //  stack; the engine keeps one for every request it has in flight.
+        //
+        struct transfer
+        {
+            transfer()
+                : recv(result)
+            {
+                recv.buffer = &result.body;
+                recv.sink = string_sink(&result.body);
+            }
+
+            httpresponse result;
+            std::unique_ptr<file_writer> file;
+            std::string data;
+            receiver recv;
+            sender send;
+            std::shared_ptr<compressor> codec;  // Set for posts
+
+        private:
+            // Noncopyable; recv points into result
+            transfer(transfer const&);
+            transfer& operator=(transfer const&);
+        };
+
+        void prepare_basic(handle&              curl,
+                           transfer&            t,
+                           std::string const&   url,
+                           int                  timeout,
+                           bool                 accept_compression = true)
+        {
+            curl.reset();
+            curl.setopt(CURLOPT_URL, url.c_str());
+            curl.setopt(CURLOPT_NOSIGNAL, 1);
+            curl.setopt(CURLOPT_NOPROGRESS, 1);
+            curl.setopt(CURLOPT_WRITEFUNCTION, &sinkfunc);
+            curl.setopt(CURLOPT_WRITEDATA, &t.recv);
+            curl.setopt(CURLOPT_HEADERFUNCTION, &headerfunc);
+            curl.setopt(CURLOPT_HEADERDATA, &t.result);
+            curl.setopt(CURLOPT_COOKIEFILE, ""); // turns on cookie engine
+            curl.setopt(CURLOPT_TIMEOUT, timeout);
+
+            // Compressed bodies are decoded as they arrive, whatever their
+            // destination
+            if (accept_compression)
+                curl.add_header(std::string("Accept-encoding: ") + accept_encoding());
+        }
+
+        void prepare_post(handle&               curl,
+                          const void*           data,
+                          size_t                size,
+                          const char*           encoding = NULL)
+        {
+            curl.setopt(CURLOPT_POST, 1);
+            curl.setopt(CURLOPT_POSTFIELDS, data);
+            curl.setopt(CURLOPT_POSTFIELDSIZE, size);
+
+            // In keeping with hurl's "do the wrong thing easily"
+            // philosophy, disable "Expect: 100-continue" header
+            curl.add_header("Expect:");
+
+            // Include appropriate content-encoding with compressed POST data
+            if (encoding)
+                curl.add_header(std::string("Content-Encoding: ") + encoding);
+        }
+
+        void start_get(handle&                  curl,
+                       transfer&                t,
+                       std::string const&       url,
+                       int                      timeout)
+        {
+            prepare_basic(curl, t, url, timeout);
+        }
+
+        void start_post(handle&                 curl,
+                        transfer&               t,
+                        std::string const&      url,
+                        std::string             data,
+                        int                     timeout,
+                        std::shared_ptr<compressor> const& codec)
+        {
+            prepare_basic(curl, t, url, timeout);
+
+            t.codec = codec;
+            const char* encoding = codec->apply(data);
+
+            t.data.swap(data);
+            prepare_post(curl, t.data.data(), t.data.size(), encoding);
+        }
+
+        void start_download(handle&             curl,
+                            transfer&           t,
+                            std::string const&  url,
+                            std::string const&  localpath,
+                            int                 timeout,
+                            downloadoptions const& options = downloadoptions())
+        {
+            t.recv.buffer = NULL;
+            t.file.reset(new file_writer(localpath, 0, true, options));
+            t.recv.file = t.file.get();
+            t.recv.sink = file_sink(t.file.get());
+            prepare_basic(curl, t, url, timeout);
+        }
+
+        // Divert a prepared transfer's body to the caller's sink instead
+        // of buffering it
+        void stream_to(transfer& t, bodysink const& sink)
+        {
+            t.recv.buffer = NULL;
+            t.recv.sink = sink;
+        }
+
+        // Turn the outcome of a transfer into an exception, if it failed.
+        // A write error is how a receiver stops curl, so it's only a real
+        // failure if the receiver didn't ask for it.
+        void settle(transfer& t, int code)
+        {
+            receiver& r = t.recv;
+            if (r.error)
+                std::rethrow_exception(r.error);
+            if (t.send.error)
+                std::rethrow_exception(t.send.error);
+            if (code != CURLE_WRITE_ERROR || !r.aborted)
+                check(code);
+            if (r.decoder.get() && !r.aborted && !r.decoder->finished())
+                throw std::runtime_error("failed to completely decode response body");
+        }
+
+        void perform(handle& curl, transfer& t)
+        {
+            curl.apply();
+            settle(t, curl_easy_perform(curl.get()));
+        }
+
+        // Installed by setresponsecache
+        static std::atomic<responsecache*> global_cache(NULL);
+
+        // Installed by setstatshook; loaded with std::atomic_load on every
+        // request, which libstdc++ guards with a small spinlock pool
+        static std::shared_ptr<statshook> global_statshook;
+
+        void collect_stats(handle& curl, transfer& t)
+        {
+            httpstats& stats = t.result.stats;
+            curl.getinfo(CURLINFO_NAMELOOKUP_TIME, &stats.namelookup);
+            curl.getinfo(CURLINFO_CONNECT_TIME, &stats.connect);
+            curl.getinfo(CURLINFO_APPCONNECT_TIME, &stats.appconnect);
+            curl.getinfo(CURLINFO_STARTTRANSFER_TIME, &stats.starttransfer);
+            curl.getinfo(CURLINFO_TOTAL_TIME, &stats.total);
+
+            curl_off_t up = 0, down = 0;
+            curl.getinfo(CURLINFO_SIZE_UPLOAD_T, &up);
+            curl.getinfo(CURLINFO_SIZE_DOWNLOAD_T, &down);
+            stats.uploaded = up;
+            stats.downloaded = down;
+
+            // No new connections means the request rode on an old one
+            long connects = 0;
+            curl.getinfo(CURLINFO_NUM_CONNECTS, &connects);
+            stats.reused = (connects == 0);
+
+            if (t.recv.decoder.get())
+                stats.decompress = t.recv.decoder->elapsed();
+
+            std::shared_ptr<statshook> hook = std::atomic_load(&global_statshook);
+            if (hook && *hook)
+            {
+                char* url = NULL;
+                curl.getinfo(CURLINFO_EFFECTIVE_URL, &url);
+
+                // Observing a request must not fail it
+                try
+                {
+                    (*hook)(pool_key(url ? url : ""), t.result.status, stats);
+                }
+                catch (...)
+                {
+                }
+            }
+        }
+
+        // Collect the results of a completed transfer into t.result
+        void finish(handle& curl, transfer& t)
+        {
+            long status = 0;
+            curl.getinfo(CURLINFO_RESPONSE_CODE, &status);
+            t.result.status = status;
+            collect_stats(curl, t);
+
+            // Let an adaptive compression policy learn the upload speed
+            if (t.codec)
+            {
+                double pretransfer = 0;
+                curl.getinfo(CURLINFO_PRETRANSFER_TIME, &pretransfer);
+                t.codec->observe(t.result.stats.uploaded,
+                                 t.result.stats.starttransfer - pretransfer);
+            }
+
+            if (t.file)
+                t.file->close();
+        }
+
+        // Start a transfer off with an old response's buffers, so that it
+        // fills memory already allocated rather than allocating afresh. The
+        // old response is left empty, in case the transfer fails.
+        void reuse(transfer& t, httpresponse& old)
+        {
+            t.result.body.swap(old.body);
+            t.result.body.clear();
+            t.result.headers = std::move(old.headers);
+            t.result.headers.clear();
+            old.headers.clear();
+            old.status = 0;
+            old.stats = httpstats();
+        }
+
+        void get(handle&                        curl,
+                 std::string const&             url,
+                 httpresponse&                  into,
+                 int                            timeout,
+                 responsecache*                 cache = NULL)
+        {
+            cached_request cached(cache, url);
+            if (cached.fresh(into))
+                return;
+
+            transfer t;
+            reuse(t, into);
+            start_get(curl, t, url, timeout);
+            cached.condition(curl);
+            perform(curl, t);
+            finish(curl, t);
+            cached.complete(t.result);
+            into = std::move(t.result);
+        }
+
+        httpresponse get(handle&                curl,
+                         std::string const&     url,
+                         int                    timeout,
+                         responsecache*         cache = NULL)
+        {
+            httpresponse result;
+            get(curl, url, result, timeout, cache);
+            return result;
+        }
+
+        httpresponse post(handle&               curl,
+                          std::string const&    url,
+                          std::string           data,
+                          int                   timeout,
+                          std::shared_ptr<compressor> const& codec = global_compressor())
+        {
+            transfer t;
+            start_post(curl, t, url, std::move(data), timeout, codec);
+            perform(curl, t);
+            finish(curl, t);
+            return std::move(t.result);
+        }
+
+        void post(handle&                       curl,
+                  std::string const&            url,
+                  std::string                   data,
+                  httpresponse&                 into,
+                  int                           timeout,
+                  std::shared_ptr<compressor> const& codec = global_compressor())
+        {
+            transfer t;
+            reuse(t, into);
+            start_post(curl, t, url, std::move(data), timeout, codec);
+            perform(curl, t);
+            finish(curl, t);
+            into = std::move(t.result);
+        }
+
+        httpresponse get(handle&                curl,
+                         std::string const&     url,
+                         bodysink const&        sink,
+                         int                    timeout)
+        {
+            transfer t;
+            start_get(curl, t, url, timeout);
+            stream_to(t, sink);
+            perform(curl, t);
+            finish(curl, t);
+            return std::move(t.result);
+        }
+
+        httpresponse post(handle&               curl,
+                          std::string const&    url,
+                          std::string           data,
+                          bodysink const&       sink,
+                          int                   timeout,
+                          std::shared_ptr<compressor> const& codec = global_compressor())
+        {
+            transfer t;
+            start_post(curl, t, url, std::move(data), timeout, codec);
+            stream_to(t, sink);
+            perform(curl, t);
+            finish(curl, t);
+            return std::move(t.result);
+        }
+
+        mappedresponse getmapped(handle&            curl,
+                                 std::string const& url,
+                                 mapoptions const&  options,
+                                 int                timeout)
+        {
+            transfer t;
+            start_get(curl, t, url, timeout);
+            spill_buffer body(options);
+            t.recv.buffer = NULL;
+            t.recv.spill = &body;
+            t.recv.sink = spill_sink(&body);
+            perform(curl, t);
+            finish(curl, t);
+
+            mappedresponse result;
+            result.status = t.result.status;
+            result.headers = std::move(t.result.headers);
+            result.stats = t.result.stats;
+            result.body = body.release();
+            return result;
+        }
+
+        httpresponse download(handle&           curl,
+                        std::string const&      url,
+                        std::string const&      localpath,
+                        int                     timeout,
+                        downloadoptions const&  options = downloadoptions())
+        {
+            transfer t;
+            start_download(curl, t, url, localpath, timeout, options);
+            perform(curl, t);
+            finish(curl, t);
+            return std::move(t.result);
+        }
+    }
+
+    namespace detail
+    {
+        //
+        // descriptor
+        //  Owns a POSIX file descriptor.
+        //
+        class descriptor
+        {
+        public:
+            explicit descriptor(int fd)
+                : fd_(fd)
+            { }
+
+            ~descriptor()
+            {
+                if (fd_ >= 0)
+                    ::close(fd_);
+            }
+
+            int get() const
+            {
+                return fd_;
+            }
+
+        private:
+            int fd_;
+
+            // Noncopyable
+            descriptor(descriptor const&);
+            descriptor& operator=(descriptor const&);
+        };
+
+        // Reserve disk space for a file of the given size up front, so
+        // ranges written out of order don't fragment it
+        void preallocate(int fd, off_t size)
+        {
+#ifdef __linux__
+            if (::fallocate(fd, 0, 0, size) == 0)
+                return;
+#endif
+            // Filesystem can't preallocate; at least fix the length
+            if (::ftruncate(fd, size) != 0)
+                throw std::runtime_error("could not size download file");
+        }
+
+        //
+        // range_part
+        //  One byte range of a parallel download. Its body is written
+        //  straight into place in the output file as it arrives.
+        //
+        struct range_part
+        {
+            range_part(std::string const& url, std::string const& localpath,
+                       off_t first, off_t last, downloadoptions const& options)
+                : curl(url, 0, false), file(localpath, first, false, options), pos(first),
+                  last(last)
+            { }
+
+            pooled_handle curl;
+            transfer t;
+            file_writer file;
+            off_t pos;
+            off_t last;
+        };
+
+        struct range_sink
+        {
+            explicit range_sink(range_part* part)
+                : part(part)
+            { }
+
+            bool operator()(const char* data, size_t size) const
+            {
+                // A server that ignores Range sends the whole file; don't
+                // let it scribble over the neighbouring ranges
+                if (part->pos + (off_t)size > part->last + 1)
+                    throw std::runtime_error("server ignored range request");
+                part->file.write(data, size);
+                part->pos += size;
+                return true;
+            }
+
+            range_part* part;
+        };
+
+        // Ask the server whether it can serve byte ranges of url, and how
+        // large the file is
+        httpresponse probe(handle& curl, std::string const& url, int timeout)
+        {
+            transfer t;
+            prepare_basic(curl, t, url, timeout, false);
+            curl.setopt(CURLOPT_NOBODY, 1);
+            perform(curl, t);
+            finish(curl, t);
+            return std::move(t.result);
+        }
+
+        httpresponse download(handle&                   curl,
+                              std::string const&        url,
+                              std::string const&        localpath,
+                              downloadoptions const&    options,
+                              int                       timeout)
+        {
+            if (options.connections < 2)
+                return download(curl, url, localpath, timeout, options);
+
+            httpresponse head = probe(curl, url, timeout);
+
+            off_t size = -1;
+            if (head.headers.count("content-length"))
+                size = strtoll(head.headers["content-length"].c_str(), NULL, 10);
+            bool ranges = head.status == 200 &&
+                          tolower(head.headers["accept-ranges"]).find("bytes") != std::string::npos;
+
+            // Work out the ranges; fewer than two isn't worth the bother
+            off_t chunk = options.chunksize;
+            if (chunk <= 0 && options.connections > 0)
+                chunk = (size + options.connections - 1) / options.connections;
+            if (!ranges || size <= 0 || chunk <= 0 || chunk >= size)
+                return download(curl, url, localpath, timeout, options);
+
+            std::vector<std::pair<off_t, off_t> > todo;
+            for (off_t first = 0; first < size; first += chunk)
+                todo.push_back(std::make_pair(first, std::min(first + chunk, size) - 1));
+
+            {
+                descriptor fd(::open(localpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+                if (fd.get() < 0)
+                    throw std::runtime_error("could not open download file");
+                if (options.preallocate)
+                    preallocate(fd.get(), size);
+            }
+
+            multi m;
+            std::vector<std::unique_ptr<range_part> > active;
+            size_t next = 0;
+            try
+            {
+                while (next < todo.size() || !active.empty())
+                {
+                    while (next < todo.size() && active.size() < (size_t)options.connections)
+                    {
+                        range_part* part = new range_part(url, localpath, todo[next].first,
+                                                          todo[next].second, options);
+                        active.push_back(std::unique_ptr<range_part>(part));
+                        ++next;
+
+                        std::ostringstream range;
+                        range << part->pos << "-" << part->last;
+                        prepare_basic(*part->curl, part->t, url, timeout, false);
+                        (*part->curl).throttle(curl);
+                        (*part->curl).setopt(CURLOPT_RANGE, range.str().c_str());
+                        (*part->curl).setopt(CURLOPT_PRIVATE, part);
+                        stream_to(part->t, range_sink(part));
+                        m.add(*part->curl);
+                    }
+
+                    m.perform();
+
+                    CURL* easy;
+                    int code;
+                    while (m.next(easy, code))
+                    {
+                        range_part* part = NULL;
+                        curl_easy_getinfo(easy, CURLINFO_PRIVATE, &part);
+                        m.remove(easy);
+                        for (size_t i = 0; i < active.size(); ++i)
+                        {
+                            if (active[i].get() != part)
+                                continue;
+                            std::unique_ptr<range_part> done(std::move(active[i]));
+                            active.erase(active.begin() + i);
+
+                            settle(done->t, code);
+                            finish(*done->curl, done->t);
+                            done->file.close();
+                            if (done->t.result.status != 206 || done->pos != done->last + 1)
+                                throw std::runtime_error("server ignored range request");
+                            break;
+                        }
+                    }
+
+                    if (!active.empty())
+                        m.poll(1000);
+                }
+            }
+            catch (...)
+            {
+                // Detach the stragglers before their handles go back to the pool
+                for (size_t i = 0; i < active.size(); ++i)
+                    curl_multi_remove_handle(m.get(), (*active[i]->curl).get());
+                throw;
+            }
+
+            head.body.clear();
+            return head;
+        }
+
+        //
+        // Resumable downloads
+        //  The validator (ETag, or failing that Last-Modified) of a file
+        //  being downloaded is checkpointed in a small file beside it. A
+        //  later attempt, even from another process, can then ask for just
+        //  the remainder with If-Range and be sure it belongs to the same
+        //  version of the file; if it doesn't, the server sends the whole
+        //  thing and we start over.
+        //
+        std::string checkpoint_path(std::string const& localpath)
+        {
+            return localpath + ".hurl-resume";
+        }
+
+        std::string read_checkpoint(std::string const& localpath)
+        {
+            std::ifstream in(checkpoint_path(localpath).c_str());
+            std::string validator;
+            std::getline(in, validator);
+            return validator;
+        }
+
+        void write_checkpoint(std::string const& localpath, std::string const& validator)
+        {
+            std::ofstream out(checkpoint_path(localpath).c_str(), std::ios::out | std::ios::trunc);
+            out << validator << "\n";
+        }
+
+        void clear_checkpoint(std::string const& localpath)
+        {
+            ::unlink(checkpoint_path(localpath).c_str());
+        }
+
+        // Errors worth retrying: the network hiccuped, not the request
+        bool resumable(int code)
+        {
+            switch (code)
+            {
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_COULDNT_RESOLVE_HOST:
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_PARTIAL_FILE:
+            case CURLE_RECV_ERROR:
+            case CURLE_SEND_ERROR:
+            case CURLE_GOT_NOTHING:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        // Parse the first byte position out of "bytes first-last/total",
+        // or the total out of "bytes */total"
+        off_t content_range(std::string const& value, bool total)
+        {
+            size_t pos = value.find_first_of(total ? "/" : "0123456789*");
+            if (pos == std::string::npos || value[pos] == '*')
+                return -1;
+            return strtoll(value.c_str() + pos + (total ? 1 : 0), NULL, 10);
+        }
+
+        struct resume_state
+        {
+            resume_state(CURL* curl, int fd, off_t have, std::string const& localpath,
+                         httpresponse* resp)
+                : curl(curl), fd(fd), have(have), pos(have), localpath(localpath),
+                  resp(resp), started(false), discard(false), mismatch(false)
+            { }
+
+            CURL* curl;
+            int fd;
+            off_t have;
+            off_t pos;
+            std::string localpath;
+            httpresponse* resp;
+            bool started;
+            bool discard;
+            bool mismatch;
+        };
+
+        // Decides from the response status where the body belongs, then
+        // writes it there
+        struct resume_sink
+        {
+            explicit resume_sink(resume_state* s)
+                : s(s)
+            { }
+
+            bool operator()(const char* data, size_t size) const
+            {
+                if (!s->started)
+                {
+                    s->started = true;
+                    long status = 0;
+                    curl_easy_getinfo(s->curl, CURLINFO_RESPONSE_CODE, &status);
+                    if (status == 206)
+                    {
+                        // Only trust a range that picks up where we left off
+                        if (content_range(s->resp->headers["content-range"], false) != s->have)
+                        {
+                            s->mismatch = true;
+                            return false;
+                        }
+                    }
+                    else if (status == 200)
+                    {
+                        // A fresh copy: either there was nothing to resume
+                        // or the file changed under us
+                        restart();
+                    }
+                    else
+                    {
+                        // Never let an error page into a partial file
+                        s->discard = true;
+                    }
+                }
+
+                if (!s->discard)
+                {
+                    write_at(s->fd, data, size, s->pos);
+                    s->pos += size;
+                }
+                return true;
+            }
+
+            void restart() const
+            {
+                if (::ftruncate(s->fd, 0) != 0)
+                    throw std::runtime_error("could not truncate download file");
+                s->pos = 0;
+
+                headerlist const& headers = s->resp->headers;
+                if (headers.count("etag"))
+                    write_checkpoint(s->localpath, headers["etag"]);
+                else if (headers.count("last-modified"))
+                    write_checkpoint(s->localpath, headers["last-modified"]);
+                else
+                    clear_checkpoint(s->localpath);
+            }
+
+            resume_state* s;
+        };
+
+        httpresponse resumedownload(handle&             curl,
+                                    std::string const&  url,
+                                    std::string const&  localpath,
+                                    int                 attempts,
+                                    int                 timeout)
+        {
+            descriptor fd(::open(localpath.c_str(), O_WRONLY | O_CREAT, 0666));
+            if (fd.get() < 0)
+                throw std::runtime_error("could not open download file");
+
+            for (int attempt = 1; ; ++attempt)
+            {
+                off_t have = ::lseek(fd.get(), 0, SEEK_END);
+                std::string validator = read_checkpoint(localpath);
+                if (have < 0 || validator.empty())
+                    have = 0;
+
+                // Byte offsets refer to the identity encoding, so resumable
+                // transfers are never compressed
+                transfer t;
+                resume_state state(curl.get(), fd.get(), have, localpath, &t.result);
+                prepare_basic(curl, t, url, timeout, false);
+                stream_to(t, resume_sink(&state));
+                if (have > 0)
+                {
+                    std::ostringstream range;
+                    range << have << "-";
+                    curl.setopt(CURLOPT_RANGE, range.str().c_str());
+                    curl.add_header("If-Range: " + validator);
+                }
+
+                curl.apply();
+                int code = curl_easy_perform(curl.get());
+                if (resumable(code) && attempt < attempts)
+                {
+                    // Back off a little longer each time, up to 30s
+                    std::this_thread::sleep_for(std::chrono::seconds(std::min(1 << std::min(attempt - 1, 5), 30)));
+                    continue;
+                }
+                settle(t, code);
+                finish(curl, t);
+
+                int status = t.result.status;
+                if (state.mismatch && attempt < attempts)
+                {
+                    // The server resumed from somewhere else; start over
+                    clear_checkpoint(localpath);
+                    continue;
+                }
+                if (state.mismatch)
+                    throw std::runtime_error("server resumed download at the wrong offset");
+
+                if (status == 416 && have > 0)
+                {
+                    // Nothing left to send: done, if the sizes agree
+                    if (content_range(t.result.headers["content-range"], true) == have)
+                    {
+                        clear_checkpoint(localpath);
+                        t.result.status = 200;
+                        return std::move(t.result);
+                    }
+                    if (attempt < attempts)
+                    {
+                        clear_checkpoint(localpath);
+                        continue;
+                    }
+                }
+
+                if (status == 200 && !state.started)
+                {
+                    // An empty body never reached the sink to truncate
+                    if (::ftruncate(fd.get(), 0) != 0)
+                        throw std::runtime_error("could not truncate download file");
+                }
+                if (status == 200 || status == 206)
+                    clear_checkpoint(localpath);
+                return std::move(t.result);
+            }
+        }
+
+        // Body source that reads from a file descriptor
+        struct fd_source
+        {
+            explicit fd_source(int fd)
+                : fd(fd)
+            { }
+
+            size_t operator()(char* buffer, size_t size) const
+            {
+                for (;;)
+                {
+                    ssize_t n = ::read(fd, buffer, size);
+                    if (n >= 0)
+                        return n;
+                    if (errno != EINTR)
+                        throw std::runtime_error("failed to read request body");
+                }
+            }
+
+            int fd;
+        };
+
+        // Length of the file behind fd, or -1 if it isn't a regular file
+        long long file_length(int fd)
+        {
+            struct stat st;
+            if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+                return -1;
+            return st.st_size - ::lseek(fd, 0, SEEK_CUR);
+        }
+
+        //
+        // upload
+        //  Sends a request whose body is read from source as curl needs it.
+        //  With a known length it goes out with a Content-Length; otherwise,
+        //  or when gzipped (the compressed length can't be known up front),
+        //  with chunked transfer encoding.
+        //
+        httpresponse upload(handle&                 curl,
+                            std::string const&      url,
+                            bodysource const&       source,
+                            uploadoptions const&    options,
+                            int                     timeout)
+        {
+            transfer t;
+            prepare_basic(curl, t, url, timeout);
+
+            t.send.source = source;
+            if (options.compress)
+                t.send.encoder.reset(new deflater());
+            curl.setopt(CURLOPT_READFUNCTION, &readfunc);
+            curl.setopt(CURLOPT_READDATA, &t.send);
+
+            curl_off_t length = options.compress ? -1 : options.length;
+            if (options.method == "POST")
+            {
+                curl.setopt(CURLOPT_POST, 1);
+                if (length >= 0)
+                    curl.setopt(CURLOPT_POSTFIELDSIZE_LARGE, length);
+                else
+                    curl.add_header("Transfer-Encoding: chunked");
+            }
+            else
+            {
+                curl.setopt(CURLOPT_UPLOAD, 1);
+                if (options.method != "PUT")
+                    curl.setopt(CURLOPT_CUSTOMREQUEST, options.method.c_str());
+                if (length >= 0)
+                    curl.setopt(CURLOPT_INFILESIZE_LARGE, length);
+            }
+
+            // As with post, don't wait on "Expect: 100-continue"
+            curl.add_header("Expect:");
+            if (options.compress)
+                curl.add_header("Content-Encoding: gzip");
+            if (!options.contenttype.empty())
+                curl.add_header("Content-Type: " + options.contenttype);
+
+            perform(curl, t);
+            finish(curl, t);
+            return std::move(t.result);
+        }
+
+        httpresponse uploadfd(handle&               curl,
+                              std::string const&    url,
+                              int                   fd,
+                              uploadoptions         options,
+                              int                   timeout)
+        {
+            if (options.length < 0)
+                options.length = file_length(fd);
+            return upload(curl, url, fd_source(fd), options, timeout);
+        }
+
+        httpresponse uploadfile(handle&             curl,
+                                std::string const&  url,
+                                std::string const&  localpath,
+                                uploadoptions const& options,
+                                int                 timeout)
+        {
+            descriptor fd(::open(localpath.c_str(), O_RDONLY));
+            if (fd.get() < 0)
+                throw std::runtime_error("could not open " + localpath);
+            return uploadfd(curl, url, fd.get(), options, timeout);
+        }
+    }
+
+    namespace ext
+    {
+        void extract_tarball(std::string const& file, std::string const& extractdir)
+        {
+            TAR* t;
+
+            // libtar asks for a char*? Bad libtar! Bad! No biscuit.
+            if (tar_open(&t, const_cast<char*>(file.c_str()), NULL, O_RDONLY, 0777, TAR_GNU))
+                throw std::runtime_error("could not open tar");
+
+            if (tar_extract_all(t, const_cast<char*>(extractdir.c_str())))
+                throw std::runtime_error("could not extract tar");
+
+            tar_close(t);
+        }
+
+        //
+        // untar
+        //  A push parser for tar archives. Bytes are fed in as they arrive
+        //  and directories, files and links are created under extractdir on
+        //  the fly, so an archive never has to exist on disk as a whole.
+        //  Understands ustar, GNU long names ('L'/'K') and pax path, linkpath
+        //  and size records. Entries that would land outside extractdir are
+        //  rejected: absolute paths, ".." components, symlinks pointing
+        //  anywhere but further down the tree, and paths that pass through
+        //  a symlink the archive created earlier.
+        //
+        class untar
+        {
+        public:
+            explicit untar(std::string const& extractdir)
+                : dir_(extractdir), fill_(0), remaining_(0), padding_(0),
+                  type_(0), mode_(0), mtime_(0), paxsize_(-1), zeros_(0),
+                  ended_(false), fd_(-1)
+            {
+            }
+
+            ~untar()
+            {
+                if (fd_ >= 0)
+                    ::close(fd_);
+            }
+
+            void write(const char* data, size_t size)
+            {
+                while (size > 0 && !ended_)
+                {
+                    size_t n;
+                    if (remaining_ > 0)
+                    {
+                        n = std::min<unsigned long long>(remaining_, size);
+                        content(data, n);
+                        remaining_ -= n;
+                        if (remaining_ == 0)
+                            close_entry();
+                    }
+                    else if (padding_ > 0)
+                    {
+                        n = std::min<size_t>(padding_, size);
+                        padding_ -= n;
+                    }
+                    else
+                    {
+                        n = std::min<size_t>(BLOCK - fill_, size);
+                        memcpy(block_ + fill_, data, n);
+                        fill_ += n;
+                        if (fill_ == BLOCK)
+                        {
+                            fill_ = 0;
+                            header();
+                        }
+                    }
+                    data += n;
+                    size -= n;
+                }
+            }
+
+            // Call once the archive has been fed in completely
+            void finish()
+            {
+                if (remaining_ > 0 || padding_ > 0 || fill_ > 0)
+                    throw std::runtime_error("truncated tarball");
+            }
+
+        private:
+            enum { BLOCK = 512 };
+
+            static unsigned long long number(const char* field, size_t size)
+            {
+                // GNU base-256 for values too large for octal
+                if ((unsigned char)field[0] & 0x80)
+                {
+                    unsigned long long value = (unsigned char)field[0] & 0x7f;
+                    for (size_t i = 1; i < size; ++i)
+                        value = (value << 8) | (unsigned char)field[i];
+                    return value;
+                }
+
+                unsigned long long value = 0;
+                size_t i = 0;
+                while (i < size && (field[i] == ' ' || field[i] == '\0'))
+                    ++i;
+                for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i)
+                    value = (value << 3) | (field[i] - '0');
+                return value;
+            }
+
+            static std::string text(const char* field, size_t size)
+            {
+                return std::string(field, strnlen(field, size));
+            }
+
+            void header()
+            {
+                if (std::count(block_, block_ + BLOCK, '\0') == BLOCK)
+                {
+                    // Two zero blocks mark the end of the archive
+                    if (++zeros_ == 2)
+                        ended_ = true;
+                    return;
+                }
+                zeros_ = 0;
+
+                // The checksum treats its own field as spaces
+                unsigned long sum = 0;
+                for (size_t i = 0; i < BLOCK; ++i)
+                    sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)block_[i];
+                if (sum != number(block_ + 148, 8))
+                    throw std::runtime_error("corrupt tar header");
+
+                type_ = block_[156];
+                mode_ = number(block_ + 100, 8);
+                mtime_ = number(block_ + 136, 12);
+                remaining_ = number(block_ + 124, 12);
+
+                // Names from preceding long-name or pax entries win
+                if (!longname_.empty())
+                    path_ = longname_;
+                else
+                {
+                    path_ = text(block_, 100);
+                    std::string prefix = text(block_ + 345, 155);
+                    if (memcmp(block_ + 257, "ustar", 5) == 0 && !prefix.empty())
+                        path_ = prefix + "/" + path_;
+                }
+                link_ = longlink_.empty() ? text(block_ + 157, 100) : longlink_;
+                if (paxsize_ >= 0)
+                    remaining_ = paxsize_;
+
+                // Metadata entries describe the next one; everything else
+                // consumes what's been collected
+                bool meta = (type_ == 'L' || type_ == 'K' || type_ == 'x' || type_ == 'g');
+                if (!meta)
+                {
+                    longname_.clear();
+                    longlink_.clear();
+                    paxsize_ = -1;
+                }
+
+                padding_ = (BLOCK - remaining_ % BLOCK) % BLOCK;
+                meta_.clear();
+                open_entry();
+                if (remaining_ == 0)
+                    close_entry();
+            }
+
+            void open_entry()
+            {
+                switch (type_)
+                {
+                case '0':
+                case '\0':
+                case '7':
+                {
+                    std::string path = target(path_);
+                    ::unlink(path.c_str());
+                    links_.erase(clean(path_));
+                    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+                    if (fd_ < 0)
+                        throw std::runtime_error("could not extract tar");
+                    break;
+                }
+                case '5':
+                    makedirs(target(path_));
+                    break;
+                case '2':
+                {
+                    // Links are followed by everything after them, so they
+                    // must stay inside; later entries may not go through
+                    // them either (see clean)
+                    if (link_.empty() || link_[0] == '/' || dotdot(link_))
+                        throw std::runtime_error("unsafe link in tarball");
+                    std::string path = target(path_);
+                    ::unlink(path.c_str());
+                    if (::symlink(link_.c_str(), path.c_str()) != 0)
+                        throw std::runtime_error("could not extract tar");
+                    links_.insert(clean(path_));
+                    break;
+                }
+                case '1':
+                {
+                    std::string path = target(path_);
+                    ::unlink(path.c_str());
+                    links_.erase(clean(path_));
+                    if (::link(target(link_).c_str(), path.c_str()) != 0)
+                        throw std::runtime_error("could not extract tar");
+
+                    // A hard link to a symlink is another symlink
+                    if (links_.count(clean(link_)))
+                        links_.insert(clean(path_));
+                    break;
+                }
+                default:
+                    // Metadata is collected by content(); devices, FIFOs
+                    // and anything unknown are skipped
+                    break;
+                }
+            }
+
+            void content(const char* data, size_t size)
+            {
+                if (fd_ >= 0)
+                {
+                    while (size > 0)
+                    {
+                        ssize_t n = ::write(fd_, data, size);
+                        if (n < 0 && errno == EINTR)
+                            continue;
+                        if (n < 0)
+                            throw std::runtime_error("could not extract tar");
+                        data += n;
+                        size -= n;
+                    }
+                }
+                else if (type_ == 'L' || type_ == 'K' || type_ == 'x')
+                {
+                    meta_.append(data, size);
+                }
+            }
+
+            void close_entry()
+            {
+                if (fd_ >= 0)
+                {
+                    ::fchmod(fd_, mode_ & 07777);
+                    ::close(fd_);
+                    fd_ = -1;
+
+                    struct timeval times[2];
+                    times[0].tv_sec = times[1].tv_sec = mtime_;
+                    times[0].tv_usec = times[1].tv_usec = 0;
+                    ::utimes(target(path_).c_str(), times);
+                }
+                else if (type_ == 'L')
+                    longname_ = text(meta_.data(), meta_.size());
+                else if (type_ == 'K')
+                    longlink_ = text(meta_.data(), meta_.size());
+                else if (type_ == 'x')
+                    pax();
+            }
+
+            // Records are "<length> <key>=<value>\n"
+            void pax()
+            {
+                size_t pos = 0;
+                while (pos < meta_.size())
+                {
+                    size_t length = strtoul(meta_.c_str() + pos, NULL, 10);
+                    size_t space = meta_.find(' ', pos);
+                    if (length == 0 || space == std::string::npos || pos + length > meta_.size())
+                        break;
+                    std::string record = meta_.substr(space + 1, pos + length - space - 2);
+                    pos += length;
+
+                    size_t eq = record.find('=');
+                    if (eq == std::string::npos)
+                        continue;
+                    std::string key = record.substr(0, eq);
+                    if (key == "path")
+                        longname_ = record.substr(eq + 1);
+                    else if (key == "linkpath")
+                        longlink_ = record.substr(eq + 1);
+                    else if (key == "size")
+                        paxsize_ = strtoll(record.c_str() + eq + 1, NULL, 10);
+                }
+            }
+
+            static bool dotdot(std::string const& path)
+            {
+                size_t start = 0;
+                while (start <= path.size())
+                {
+                    size_t end = path.find('/', start);
+                    if (end == std::string::npos)
+                        end = path.size();
+                    if (path.compare(start, end - start, "..") == 0)
+                        return true;
+                    start = end + 1;
+                }
+                return false;
+            }
+
+            // Normalize an archive path relative to extractdir, refusing
+            // absolute paths, ".." and directories that are symlinks made by
+            // this archive
+            std::string clean(std::string const& path) const
+            {
+                if (path.empty() || path[0] == '/' || dotdot(path))
+                    throw std::runtime_error("unsafe path in tarball");
+
+                std::string result;
+                size_t start = 0;
+                while (start <= path.size())
+                {
+                    size_t end = path.find('/', start);
+                    if (end == std::string::npos)
+                        end = path.size();
+                    std::string part = path.substr(start, end - start);
+                    if (!part.empty() && part != ".")
+                    {
+                        if (links_.count(result))
+                            throw std::runtime_error("unsafe path in tarball");
+                        result += (result.empty() ? "" : "/") + part;
+                    }
+                    start = end + 1;
+                }
+                return result;
+            }
+
+            // Resolve an archive path under extractdir, refusing to leave it
+            std::string target(std::string const& path)
+            {
+                std::string result = dir_ + "/" + clean(path);
+
+                // Make sure the parent exists, as archives may omit it
+                makedirs(result.substr(0, result.rfind('/')));
+                return result;
+            }
+
+            static void makedirs(std::string const& path)
+            {
+                for (size_t pos = 0; pos != std::string::npos; )
+                {
+                    pos = path.find('/', pos + 1);
+                    std::string dir = path.substr(0, pos);
+                    if (::mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+                        throw std::runtime_error("could not extract tar");
+                }
+            }
+
+            std::string dir_;
+            char block_[BLOCK];
+            size_t fill_;
+            unsigned long long remaining_;
+            size_t padding_;
+
+            char type_;
+            unsigned long mode_;
+            time_t mtime_;
+            std::string path_;
+            std::string link_;
+
+            std::string meta_;
+            std::string longname_;
+            std::string longlink_;
+            long long paxsize_;
+            std::set<std::string> links_;   // Symlinks extracted so far
+
+            int zeros_;
+            bool ended_;
+            int fd_;
+
+            // Noncopyable
+            untar(untar const&);
+            untar& operator=(untar const&);
+        };
+    }
+
+    namespace detail
+    {
+        struct untar_sink
+        {
+            explicit untar_sink(ext::untar* tar)
+                : tar(tar)
+            { }
+
+            bool operator()(const char* data, size_t size) const
+            {
+                tar->write(data, size);
+                return true;
+            }
+
+            ext::untar* tar;
+        };
+
+        struct tarball_state
+        {
+            tarball_state(CURL* curl, std::string const& extractdir)
+                : curl(curl), tar(extractdir), started(false), extract(false)
+            { }
+
+            CURL* curl;
+            ext::untar tar;
+            std::unique_ptr<inflater> gz;
+            std::ofstream archive;
+            std::string sniff;
+            bool started;
+            bool extract;
+        };
+
+        // Optionally tees the archive to disk while extracting it
+        struct tarball_sink
+        {
+            tarball_sink(tarball_state* s, bool gunzip)
+                : s(s), gunzip(gunzip)
+            { }
+
+            bool operator()(const char* data, size_t size) const
+            {
+                if (!s->started)
+                {
+                    // Only a 200 is the tarball; anything else is an error page
+                    s->started = true;
+                    long status = 0;
+                    curl_easy_getinfo(s->curl, CURLINFO_RESPONSE_CODE, &status);
+                    s->extract = (status == 200);
+                }
+
+                if (s->archive.is_open() && !s->archive.write(data, size))
+                    throw std::runtime_error("failed to write response body");
+                if (!s->extract)
+                    return true;
+
+                // Hold the first couple of bytes back until we know whether
+                // they're a gzip magic number
+                if (gunzip && s->sniff.size() < 2 && !s->gz.get())
+                {
+                    s->sniff.append(data, size);
+                    if (s->sniff.size() < 2)
+                        return true;
+                    if ((unsigned char)s->sniff[0] == 0x1f && (unsigned char)s->sniff[1] == 0x8b)
+                        s->gz.reset(new inflater());
+                    feed(s->sniff.data(), s->sniff.size());
+                    return true;
+                }
+                feed(data, size);
+                return true;
+            }
+
+            void feed(const char* data, size_t size) const
+            {
+                if (s->gz.get())
+                    s->gz->write(data, size, untar_sink(&s->tar));
+                else
+                    s->tar.write(data, size);
+            }
+
+            tarball_state* s;
+            bool gunzip;
+        };
+
+        httpresponse downloadtarball(handle&                curl,
+                                     std::string const&     url,
+                                     std::string const&     localpath,
+                                     std::string const&     extractdir,
+                                     tarballoptions const&  options,
+                                     int                    timeout)
+        {
+            transfer t;
+            tarball_state state(curl.get(), extractdir);
+            if (options.keeparchive)
+            {
+                state.archive.open(localpath.c_str(), std::ios::out |
+                                                      std::ios::binary |
+                                                      std::ios::trunc);
+                if (!state.archive)
+                    throw std::runtime_error("could not open download file");
+            }
+
+            prepare_basic(curl, t, url, timeout);
+            stream_to(t, tarball_sink(&state, options.gunzip));
+            perform(curl, t);
+            finish(curl, t);
+
+            if (state.extract)
+            {
+                if (state.sniff.size() < 2 && !state.gz.get())
+                    state.tar.write(state.sniff.data(), state.sniff.size());
+                if (state.gz.get() && !state.gz->finished())
+                    throw std::runtime_error("failed to completely inflate");
+                state.tar.finish();
+            }
+            return std::move(t.result);
+        }
+    }
+
+    //
+    // Retries and hedged requests
+    //
+    namespace detail
+    {
+        // The number of seconds a Retry-After header asks for, or -1 if
+        // there is none (or it makes no sense)
+        double retry_after(std::string_view value)
+        {
+            if (value.empty())
+                return -1;
+            if (isdigit((unsigned char)value[0]))
+                return strtod(std::string(value).c_str(), NULL);
+            time_t date = httpdate(value);
+            if (date < 0)
+                return -1;
+            return std::max(0.0, difftime(date, time(NULL)));
+        }
+
+        // Whether a curl error means the connection let the request down,
+        // rather than the request itself being wrong
+        bool transient(int code)
+        {
+            return code == CURLE_SEND_ERROR || code == CURLE_RECV_ERROR ||
+                   code == CURLE_GOT_NOTHING || code == CURLE_PARTIAL_FILE ||
+                   code == CURLE_HTTP2 || code == CURLE_HTTP2_STREAM;
+        }
+
+        double seconds_since(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        //
+        // retrier
+        //  A retrypolicy in force, along with what it learns as it goes:
+        //  the latencies of recent requests, from which to time hedges, and
+        //  the random numbers for jitter. Shared by every request under the
+        //  policy, from any thread.
+        //
+        class retrier
+        {
+        public:
+            static const size_t window = 256;
+
+            explicit retrier(retrypolicy const& policy)
+                : policy_(policy), random_(std::random_device()()), next_(0)
+            {
+                latencies_.reserve(window);
+            }
+
+            retrypolicy const& policy() const
+            {
+                return policy_;
+            }
+
+            bool retryable(int status, bool idempotent) const
+            {
+                if (!idempotent && !policy_.posts)
+                    return false;
+                return std::find(policy_.statuses.begin(), policy_.statuses.end(), status) !=
+                       policy_.statuses.end();
+            }
+
+            bool retryable(std::exception_ptr const& error, bool idempotent) const
+            {
+                // Nothing was sent if the connection never came up
+                int flag = 0;
+                bool sent = true;
+                try
+                {
+                    std::rethrow_exception(error);
+                }
+                catch (timeout const&)
+                {
+                    flag = retrypolicy::timeouts;
+                }
+                catch (connect_error const&)
+                {
+                    flag = retrypolicy::connecterrors;
+                    sent = false;
+                }
+                catch (resolve_error const&)
+                {
+                    flag = retrypolicy::resolveerrors;
+                    sent = false;
+                }
+                catch (curl_error const& e)
+                {
+                    if (transient(e.code()))
+                        flag = retrypolicy::transporterrors;
+                }
+                catch (...)
+                {
+                }
+                return (policy_.errors & flag) && (idempotent || policy_.posts || !sent);
+            }
+
+            // The wait before retry n (counting from 1), in seconds, or -1
+            // if the server asked for longer than the policy will wait
+            double backoff(int n, std::string_view retryafter)
+            {
+                double delay = std::min(policy_.initialdelay * std::pow(policy_.multiplier, n - 1),
+                                        policy_.maxdelay);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    std::uniform_real_distribution<double> uniform(0, 1);
+                    delay *= 1 - std::min(std::max(policy_.jitter, 0.0), 1.0) * uniform(random_);
+                }
+
+                double asked = policy_.retryafter ? retry_after(retryafter) : -1;
+                if (asked > policy_.maxdelay)
+                    return -1;
+                return std::max(delay, asked);
+            }
+
+            // How long to give a GET before hedging it, or -1 not to
+            double hedgedelay()
+            {
+                if (policy_.hedgequantile > 0)
+                {
+                    std::vector<double> sorted;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        if (latencies_.size() >= 20)
+                            sorted = latencies_;
+                    }
+                    if (!sorted.empty())
+                    {
+                        double q = std::min(policy_.hedgequantile, 1.0);
+                        std::vector<double>::iterator at =
+                            sorted.begin() + (size_t)(q * (sorted.size() - 1));
+                        std::nth_element(sorted.begin(), at, sorted.end());
+                        return *at;
+                    }
+                }
+                return policy_.hedgeafter > 0 ? policy_.hedgeafter : -1;
+            }
+
+            void observe(double latency)
+            {
+                if (policy_.hedgequantile <= 0)
+                    return;
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (latencies_.size() < window)
+                    latencies_.push_back(latency);
+                else
+                    latencies_[next_++ % window] = latency;
+            }
+
+        private:
+            retrypolicy policy_;
+            std::mutex mutex_;
+            std::mt19937 random_;
+            std::vector<double> latencies_;
+            size_t next_;
+        };
+
+        // Installed by setretrypolicy; none until then
+        static std::shared_ptr<retrier> global_retry;
+
+        std::shared_ptr<retrier> global_retrier()
+        {
+            return std::atomic_load(&global_retry);
+        }
+
+        //
+        // attempt
+        //  One try at a buffered request, which retry() repeats as its
+        //  policy says. run() makes the request, giving up after timeout
+        //  seconds (0 for never); hedge() makes a GET twice over, the second
+        //  copy after delay seconds, and keeps whichever answers first.
+        //
+        class attempt
+        {
+        public:
+            virtual ~attempt() { }
+
+            virtual bool idempotent() const = 0;
+
+            virtual void run(httpresponse& into, int timeout) = 0;
+
+            virtual void hedge(httpresponse& into, int timeout, double /* delay */)
+            {
+                run(into, timeout);
+            }
+        };
+
+        // The multi hedged GETs run on. Connections belong to the multi
+        // they were made on, so it lives as long as the thread: a GET's
+        // keep-alive connection is then still there for the next one
+        multi& hedging()
+        {
+            static thread_local multi m;
+            return m;
+        }
+
+        //
+        // hedged_get
+        //  A GET on first, and if it hasn't finished after delay seconds,
+        //  the same GET on second as well. The first copy to answer wins,
+        //  and the other is abandoned; a copy that fails only fails the
+        //  whole if the other can't answer instead.
+        //
+        void hedged_get(handle&                 first,
+                        handle&                 second,
+                        std::string const&      url,
+                        httpresponse&           into,
+                        int                     timeout,
+                        responsecache*          cache,
+                        double                  delay)
+        {
+            cached_request cached(cache, url);
+            if (cached.fresh(into))
+                return;
+
+            handle* curls[2] = { &first, &second };
+            transfer copies[2];
+            bool running[2] = { false, false };
+            bool hedged = false;
+            int winner = -1;
+
+            // The second copy goes no faster than the first
+            second.throttle(first);
+            reuse(copies[0], into);
+            start_get(first, copies[0], url, timeout);
+            cached.condition(first);
+
+            multi& m = hedging();
+            m.add(first);
+            running[0] = true;
+            std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(delay));
+            try
+            {
+                while (winner < 0)
+                {
+                    m.perform();
+
+                    CURL* easy;
+                    int code;
+                    while (winner < 0 && m.next(easy, code))
+                    {
+                        int i = (easy == first.get()) ? 0 : 1;
+                        m.remove(easy);
+                        running[i] = false;
+                        try
+                        {
+                            settle(copies[i], code);
+                            winner = i;
+                        }
+                        catch (...)
+                        {
+                            // The other copy may yet answer
+                            if (!running[1 - i])
+                                throw;
+                        }
+                    }
+                    if (winner >= 0)
+                        break;
+
+                    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                    if (!hedged && now >= when)
+                    {
+                        start_get(second, copies[1], url, timeout);
+                        cached.condition(second);
+                        m.add(second);
+                        running[1] = hedged = true;
+                    }
+
+                    int wait = 1000;
+                    if (!hedged)
+                        wait = (int)std::min<long long>(wait,
+                            std::chrono::duration_cast<std::chrono::milliseconds>(when - now).count() + 1);
+                    m.poll(wait);
+                }
+            }
+            catch (...)
+            {
+                // Detach the stragglers before their handles go back
+                for (int i = 0; i < 2; ++i)
+                    if (running[i])
+                        curl_multi_remove_handle(m.get(), curls[i]->get());
+                throw;
+            }
+
+            if (running[1 - winner])
+                m.remove(curls[1 - winner]->get());
+            finish(*curls[winner], copies[winner]);
+            cached.complete(copies[winner].result);
+            into = std::move(copies[winner].result);
+        }
+
+        //
+        // retry
+        //  Make a request until it succeeds, or fails in a way the policy
+        //  doesn't retry, or the policy's attempts or deadline run out; the
+        //  last response is then left in into, or the last error thrown.
+        //  Without a policy, the request is made just once.
+        //
+        void retry(std::shared_ptr<retrier> const&  policy,
+                   attempt&                         request,
+                   httpresponse&                    into,
+                   int                              timeout)
+        {
+            if (!policy)
+                return request.run(into, timeout);
+
+            retrypolicy const& p = policy->policy();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int n = 1; ; ++n)
+            {
+                int limit = timeout;
+                if (p.deadline > 0)
+                {
+                    int left = std::max(1, (int)std::ceil(p.deadline - seconds_since(start)));
+                    limit = (timeout > 0) ? std::min(timeout, left) : left;
+                }
+
+                double wait;
+                try
+                {
+                    std::chrono::steady_clock::time_point begun = std::chrono::steady_clock::now();
+                    double delay = request.idempotent() ? policy->hedgedelay() : -1;
+                    if (delay >= 0)
+                        request.hedge(into, limit, delay);
+                    else
+                        request.run(into, limit);
+                    // Only learn from answers that came over the network; a
+                    // cache hit or a quick failure would drag the quantile
+                    // towards zero and hedge everything
+                    bool failed = policy->retryable(into.status, request.idempotent());
+                    if (!failed && into.stats.total > 0)
+                        policy->observe(seconds_since(begun));
+
+                    if (n >= p.attempts || !failed)
+                        return;
+                    wait = policy->backoff(n, into.headers.get("retry-after"));
+                    if (wait < 0 || (p.deadline > 0 && seconds_since(start) + wait >= p.deadline))
+                        return;
+                }
+                catch (...)
+                {
+                    if (n >= p.attempts ||
+                        !policy->retryable(std::current_exception(), request.idempotent()))
+                        throw;
+                    wait = policy->backoff(n, std::string_view());
+                    if (p.deadline > 0 && seconds_since(start) + wait >= p.deadline)
+                        throw;
+                }
+                std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+            }
+        }
+
+        // A free function's GET, on handles from the pool
+        class pooled_get : public attempt
+        {
+        public:
+            pooled_get(std::string const& url, responsecache* cache)
+                : url_(url), cache_(cache)
+            { }
+
+            bool idempotent() const
+            {
+                return true;
+            }
+
+            void run(httpresponse& into, int timeout)
+            {
+                pooled_handle curl(url_, timeout);
+                get(*curl, url_, into, timeout, cache_);
+            }
+
+            void hedge(httpresponse& into, int timeout, double delay)
+            {
+                pooled_handle first(url_, timeout);
+                pooled_handle second(url_, timeout, false);
+                hedged_get(*first, *second, url_, into, timeout, cache_, delay);
+            }
+
+        private:
+            std::string const& url_;
+            responsecache* cache_;
+        };
+
+        // A free function's POST, on a handle from the pool
+        class pooled_post : public attempt
+        {
+        public:
+            pooled_post(std::string const& url, std::string const& data)
+                : url_(url), data_(data)
+            { }
+
+            bool idempotent() const
+            {
+                return false;
+            }
+
+            void run(httpresponse& into, int timeout)
+            {
+                pooled_handle curl(url_, timeout);
+                post(*curl, url_, data_, into, timeout);
+            }
+
+        private:
+            std::string const& url_;
+            std::string const& data_;
+        };
+    }
+
+    //
+    // Implementations for the GET/POST free functions
+    //
+    //  Each call borrows a handle from the connection pool, so repeated
+    //  requests to the same host reuse keep-alive connections.
+    //
+    void setpoollimits(size_t maxperhost, int idletimeout)
+    {
+        detail::pool.configure(maxperhost, idletimeout);
+    }
+
+    void setstatshook(statshook const& hook)
+    {
+        std::shared_ptr<statshook> p;
+        if (hook)
+            p.reset(new statshook(hook));
+        std::atomic_store(&detail::global_statshook, p);
+    }
+
+    void setresponsecache(responsecache* cache)
+    {
+        detail::global_cache.store(cache);
+    }
+
+    void setcompression(compressionpolicy const& policy)
+    {
+        std::atomic_store(&detail::global_compression,
+                          std::make_shared<detail::compressor>(policy));
+    }
+
+    void setretrypolicy(retrypolicy const& policy)
+    {
+        std::atomic_store(&detail::global_retry, std::make_shared<detail::retrier>(policy));
+    }
+
+    void setratelimiter(ratelimiter* limiter)
+    {
+        detail::global_limiter.store(limiter);
+    }
+
+    httpresponse get(std::string const& url, int timeout)
+    {
+        httpresponse result;
+        get(url, result, timeout);
+        return result;
+    }
+
+    httpresponse get(std::string const& url, httpparams const& params, int timeout)
+    {
+        httpresponse result;
+        get(detail::query(url, params), result, timeout);
+        return result;
+    }
+
+    void get(std::string const& url, httpresponse& into, int timeout)
+    {
+        detail::pooled_get request(url, detail::global_cache.load());
+        detail::retry(detail::global_retrier(), request, into, timeout);
+    }
+
+    httpresponse post(std::string const& url, std::string const& data, int timeout)
+    {
+        httpresponse result;
+        detail::pooled_post request(url, data);
+        detail::retry(detail::global_retrier(), request, result, timeout);
+        return result;
+    }
+
+    httpresponse post(std::string const& url, httpparams const& params, int timeout)
+    {
+        return post(url, detail::serialize(params), timeout);
+    }
+
+    std::string urlencode(std::string_view value)
+    {
+        std::string result(detail::escaped_size(value), '\0');
+        detail::escape(value, &result[0]);
+        return result;
+    }
+
+    std::string formencode(httpparams const& params)
+    {
+        return detail::form(params);
+    }
+
+    std::string formencode(paramlist const& params)
+    {
+        return detail::form(params);
+    }
+
+    std::string formencode(paramviews const& params)
+    {
+        return detail::form(params);
+    }
+
+    httpresponse get(std::string const& url, bodysink const& sink, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::get(*curl, url, sink, timeout);
+    }
+
+    httpresponse get(std::string const& url, httpparams const& params,
+                     bodysink const& sink, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::get(*curl, detail::query(url, params), sink, timeout);
+    }
+
+    httpresponse post(std::string const& url, std::string const& data,
+                      bodysink const& sink, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::post(*curl, url, data, sink, timeout);
+    }
+
+    httpresponse post(std::string const& url, httpparams const& params,
+                      bodysink const& sink, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::post(*curl, url, detail::serialize(params), sink, timeout);
+    }
+
+    httpresponse upload(std::string const& url, bodysource const& source,
+                        uploadoptions const& options, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::upload(*curl, url, source, options, timeout);
+    }
+
+    httpresponse uploadfile(std::string const& url, std::string const& localpath,
+                            uploadoptions const& options, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::uploadfile(*curl, url, localpath, options, timeout);
+    }
+
+    httpresponse uploadfd(std::string const& url, int fd,
+                          uploadoptions const& options, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::uploadfd(*curl, url, fd, options, timeout);
+    }
+
+    mappedresponse getmapped(std::string const& url, mapoptions const& options, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::getmapped(*curl, url, options, timeout);
+    }
+
+    httpresponse download(std::string const& url, std::string const& localpath, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::download(*curl, url, localpath, timeout);
+    }
+
+    httpresponse download(std::string const& url, std::string const& localpath,
+                          downloadoptions const& options, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::download(*curl, url, localpath, options, timeout);
+    }
+
+    httpresponse resumedownload(std::string const& url, std::string const& localpath,
+                                int attempts, int timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::resumedownload(*curl, url, localpath, attempts, timeout);
+    }
+
+    httpresponse downloadtarball(std::string const& url,
+                                 std::string const& localpath,
+                                 std::string const& extractdir,
+                                 int                timeout)
+    {
+        httpresponse result = download(url, localpath, timeout);
+        if (result.status == 200)
+            ext::extract_tarball(localpath, extractdir);
+        return result;
+    }
+
+    httpresponse downloadtarball(std::string const&     url,
+                                 std::string const&     localpath,
+                                 std::string const&     extractdir,
+                                 tarballoptions const&  options,
+                                 int                    timeout)
+    {
+        detail::pooled_handle curl(url, timeout);
+        return detail::downloadtarball(*curl, url, localpath, extractdir, options, timeout);
+    }
+
+
+    //
+    // session_cache class implementation
+    //
+    namespace detail
+    {
+        // One lock per kind of shared data, as curl asks for them
+        struct share_locks
+        {
+            std::mutex locks[CURL_LOCK_DATA_LAST];
+        };
+
+        extern "C" void share_lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr)
+        {
+            static_cast<share_locks*>(userptr)->locks[data].lock();
+        }
+
+        extern "C" void share_unlock(CURL*, curl_lock_data data, void* userptr)
+        {
+            static_cast<share_locks*>(userptr)->locks[data].unlock();
+        }
+    }
+
+    class session_cache::impl
+    {
+    public:
+        explicit impl(int what)
+            : share_(curl_share_init())
+        {
+            if (share_ == NULL)
+                throw std::runtime_error("curl_share_init failed");
+
+            try
+            {
+                setopt(CURLSHOPT_LOCKFUNC, &detail::share_lock);
+                setopt(CURLSHOPT_UNLOCKFUNC, &detail::share_unlock);
+                setopt(CURLSHOPT_USERDATA, &locks_);
+                if (what & session_cache::dns)
+                    setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                if (what & session_cache::tls)
+                    setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+                if (what & session_cache::connections)
+                    setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+                if (what & session_cache::cookies)
+                    setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+            }
+            catch (...)
+            {
+                curl_share_cleanup(share_);
+                throw;
+            }
+        }
+
+        ~impl()
+        {
+            curl_share_cleanup(share_);
+        }
+
+        template<typename T, typename U>
+        void setopt(T option, U value)
+        {
+            CURLSHcode code = curl_share_setopt(share_, option, value);
+            if (CURLSHE_OK != code)
+                throw std::runtime_error(curl_share_strerror(code));
+        }
+
+        CURLSH* share_;
+        detail::share_locks locks_;
+    };
+
+    session_cache::session_cache(int what)
+        : impl_(new impl(what))
+    {
+    }
+
+    session_cache::~session_cache()
+    {
+    }
+
+    void* session_cache::native() const
+    {
+        return impl_->share_;
+    }
+
+    void setsessioncache(session_cache* cache)
+    {
+        detail::global_share.store(cache ? static_cast<CURLSH*>(cache->native()) : NULL);
+    }
+
+
+    //
+    // bufferpool class implementation
+    //
+    class bufferpool::impl
+    {
+    public:
+        explicit impl(size_t maxbuffers)
+            : max_(maxbuffers)
+        {
+        }
+
+        size_t max_;
+        std::mutex mutex_;
+        std::vector<std::string> free_;
+    };
+
+    bufferpool::bufferpool(size_t maxbuffers)
+        : impl_(new impl(maxbuffers))
+    {
+    }
+
+    bufferpool::~bufferpool()
+    {
+    }
+
+    std::string bufferpool::acquire()
+    {
+        std::string buffer;
+        std::lock_guard<std::mutex> lock(impl_->mutex_);
+        if (!impl_->free_.empty())
+        {
+            buffer.swap(impl_->free_.back());
+            impl_->free_.pop_back();
+        }
+        return buffer;
+    }
+
+    void bufferpool::recycle(std::string&& buffer)
+    {
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(impl_->mutex_);
+        if (impl_->free_.size() < impl_->max_)
+            impl_->free_.push_back(std::move(buffer));
+    }
+
+
+    //
+    // responsecache public functions; the implementation is with the
+    // transfer code, which uses it
+    //
+    responsecache::responsecache(size_t maxbytes, std::string const& directory,
+                                 size_t maxdiskbytes)
+        : impl_(new impl(maxbytes, directory, maxdiskbytes))
+    {
+    }
+
+    responsecache::~responsecache()
+    {
+    }
+
+    cachestats responsecache::stats() const
+    {
+        return impl_->stats();
+    }
+
+    void responsecache::clear()
+    {
+        impl_->clear();
+    }
+
+
+    namespace detail
+    {
+        class loop;
+        struct job;
+    }
+
+    //
+    // client class implementation
+    //
+    //  Each request borrows a handle from the client's own pool, so any
+    //  number of them can be in flight at once; the pool's lock is only
+    //  held long enough to pop or push a handle. The handles all join one
+    //  session cache, private to the client unless setsessioncache says
+    //  otherwise, which holds the cookie jar along with DNS and TLS
+    //  sessions. So the session looks the same whichever handle a request
+    //  happens to land on.
+    //
+    class client::impl
+    {
+    public:
+        impl(std::string const& baseurl, int timeout)
+            : base_(baseurl), key_(detail::pool_key(baseurl)), timeout_(timeout),
+              own_(session_cache::dns | session_cache::tls | session_cache::cookies),
+              share_(static_cast<CURLSH*>(own_.native())), buffers_(NULL),
+              cache_(NULL), limiter_(NULL), multiplexing_(false)
+        {
+        }
+
+        ~impl()
+        {
+            for (size_t i = 0; i < idle_.size(); ++i)
+                delete idle_[i];
+        }
+
+        detail::handle* acquire()
+        {
+            detail::handle* curl = NULL;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!idle_.empty())
+                {
+                    curl = idle_.back();
+                    idle_.pop_back();
+                }
+            }
+            if (curl == NULL)
+                curl = new detail::handle();
+
+            try
+            {
+                curl->share(share_.load());
+            }
+            catch (...)
+            {
+                delete curl;
+                throw;
+            }
+            return curl;
+        }
+
+        void release(detail::handle* curl)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            idle_.push_back(curl);
+        }
+
+        // The client's compression policy, or the global one if it has none
+        std::shared_ptr<detail::compressor> codec() const
+        {
+            std::shared_ptr<detail::compressor> own = std::atomic_load(&codec_);
+            return own ? own : detail::global_compressor();
+        }
+
+        // The client's retry policy, or the global one if it has none
+        std::shared_ptr<detail::retrier> retrier() const
+        {
+            std::shared_ptr<detail::retrier> own = std::atomic_load(&retry_);
+            return own ? own : detail::global_retrier();
+        }
+
+        // The engine loop for async and multiplexed requests, created on
+        // demand (defined with the engine, below)
+        std::shared_ptr<detail::loop> async();
+
+        // Hands a prepared request to the client's engine loop
+        void submit(detail::job* j);
+
+        // A response to collect a body into, with a recycled buffer if the
+        // client has a pool
+        httpresponse response()
+        {
+            httpresponse result;
+            if (bufferpool* pool = buffers_.load())
+                result.body = pool->acquire();
+            return result;
+        }
+
+        // Borrows one of the client's handles for the duration of a request,
+        // which first passes the client's rate limiter, waiting no longer
+        // than timeout, unless paced is false
+        class lease
+        {
+        public:
+            lease(impl& owner, int timeout, bool paced = true)
+                : owner_(owner),
+                  admit_(paced ? owner.limiter_.load() : NULL, owner.key_, timeout),
+                  curl_(owner.acquire())
+            {
+                admit_.throttle(*curl_);
+            }
+
+            ~lease()
+            {
+                owner_.release(curl_);
+            }
+
+            detail::handle& operator*()
+            {
+                return *curl_;
+            }
+
+        private:
+            impl& owner_;
+            detail::admission admit_;
+            detail::handle* curl_;
+
+            // Noncopyable
+            lease(lease const&);
+            lease& operator=(lease const&);
+        };
+
+        //
+        // request
+        //  One try at a buffered GET (data NULL) or POST, for detail::retry:
+        //  on the engine if engine is set, otherwise on borrowed handles.
+        //  path includes any query.
+        //
+        class request : public detail::attempt
+        {
+        public:
+            request(client&             owner,
+                    std::string const&  path,
+                    std::string const*  data,
+                    bool                engine)
+                : owner_(owner), self_(*owner.impl_), path_(path), data_(data),
+                  engine_(engine)
+            { }
+
+            bool idempotent() const
+            {
+                return data_ == NULL;
+            }
+
+            void run(httpresponse& into, int timeout)
+            {
+                if (engine_)
+                {
+                    into = data_ ? owner_.postasync(path_, *data_).get()
+                                 : owner_.getasync(path_).get();
+                    return;
+                }
+
+                lease curl(self_, timeout);
+                if (data_)
+                    detail::post(*curl, self_.base_ + path_, *data_, into, timeout,
+                                 self_.codec());
+                else
+                    detail::get(*curl, self_.base_ + path_, into, timeout,
+                                self_.cache_.load());
+            }
+
+            void hedge(httpresponse& into, int timeout, double delay)
+            {
+                if (engine_)
+                    return run(into, timeout);
+
+                lease first(self_, timeout);
+                lease second(self_, timeout, false);
+                detail::hedged_get(*first, *second, self_.base_ + path_, into, timeout,
+                                   self_.cache_.load(), delay);
+            }
+
+        private:
+            client& owner_;
+            impl& self_;
+            std::string const& path_;
+            std::string const* data_;
+            bool engine_;
+        };
+
+        std::string base_;
+        std::string key_;       // The pool key of base_, for rate limiting
+        int timeout_;
+        session_cache own_;
+        std::atomic<CURLSH*> share_;
+        std::atomic<bufferpool*> buffers_;
+        std::atomic<responsecache*> cache_;
+        std::atomic<ratelimiter*> limiter_;
+        std::shared_ptr<detail::compressor> codec_;
+        std::shared_ptr<detail::retrier> retry_;
+        std::atomic<bool> multiplexing_;
+        std::mutex mutex_;
+        std::vector<detail::handle*> idle_;
+
+        // Destroyed before own_, which requests in flight still use
+        engineoptions options_;
+        std::shared_ptr<detail::loop> engine_;
+    };
+
+    client::client(std::string const& baseurl, int timeout)
+        : impl_(new impl(baseurl, timeout))
+    {
+    }
+
+    client::~client()
+    {
+        // This destructor is empty but vital! Without it, unique_ptr cannot
+        // generate a call to impl's destructor. For an interesting look
+        // at this and other PIMPL issues, see Herb Sutter's GOTW #100.
+        // (http://herbsutter.com/gotw/_100)
+    }
+
+    std::string client::base() const
+    {
+        return impl_->base_;
+    }
+
+    void client::setsessioncache(session_cache* cache)
+    {
+        // Carry the cookie jar over to the new cache
+        std::string jar = cookie();
+        impl_->share_.store(static_cast<CURLSH*>(cache ? cache->native()
+                                                       : impl_->own_.native()));
+        setcookie(jar);
+    }
+
+    void client::setbufferpool(bufferpool* pool)
+    {
+        impl_->buffers_.store(pool);
+    }
+
+    void client::setresponsecache(responsecache* cache)
+    {
+        impl_->cache_.store(cache);
+    }
+
+    void client::setmultiplexing(engineoptions const& options)
+    {
+        // The old engine is destroyed outside the lock, which waits for
+        // its requests to finish
+        std::shared_ptr<detail::loop> old;
+        {
+            std::lock_guard<std::mutex> lock(impl_->mutex_);
+            impl_->options_ = options;
+            old.swap(impl_->engine_);
+        }
+        impl_->multiplexing_.store(true);
+    }
+
+    void client::setcompression(compressionpolicy const& policy)
+    {
+        std::atomic_store(&impl_->codec_,
+                          std::make_shared<detail::compressor>(policy));
+    }
+
+    void client::setretrypolicy(retrypolicy const& policy)
+    {
+        std::atomic_store(&impl_->retry_, std::make_shared<detail::retrier>(policy));
+    }
+
+    void client::setratelimiter(ratelimiter* limiter)
+    {
+        impl_->limiter_.store(limiter);
+    }
+
+    std::string client::cookie() const
+    {
+        impl::lease curl(*impl_, 0, false);
+        curl_slist* list = NULL;
+        (*curl).getinfo(CURLINFO_COOKIELIST, &list);
+        std::ostringstream result;
+        for (curl_slist* it = list; it; it = it->next)
+            result << it->data << "\n";
+        curl_slist_free_all(list);
+        return result.str();
+    }
+
+    void client::setcookie(std::string const& data)
+    {
+        impl::lease curl(*impl_, 0, false);
+        (*curl).setopt(CURLOPT_COOKIELIST, "ALL");
+        std::istringstream ss(data);
+        std::string line;
+        while (!ss.eof())
+        {
+            std::getline(ss, line);
+            (*curl).setopt(CURLOPT_COOKIELIST, line.c_str());
         }
+    }
+
+    httpresponse client::get(std::string const& path)
+    {
+        bool engine = impl_->multiplexing_.load();
+        httpresponse result = engine ? httpresponse() : impl_->response();
+        impl::request request(*this, path, NULL, engine);
+        detail::retry(impl_->retrier(), request, result, impl_->timeout_);
+        return result;
+    }
+
+    httpresponse client::get(std::string const& path, httpparams const& params)
+    {
+        return get(path + "?" + detail::serialize(params));
+    }
+
+    void client::get(std::string const& path, httpresponse& into)
+    {
+        bool engine = impl_->multiplexing_.load();
+        if (engine)
+            into = httpresponse();
+        impl::request request(*this, path, NULL, engine);
+        detail::retry(impl_->retrier(), request, into, impl_->timeout_);
+    }
+
+    httpresponse client::post(std::string const& path, std::string const& data)
+    {
+        bool engine = impl_->multiplexing_.load();
+        httpresponse result = engine ? httpresponse() : impl_->response();
+        impl::request request(*this, path, &data, engine);
+        detail::retry(impl_->retrier(), request, result, impl_->timeout_);
+        return result;
+    }
+
+    httpresponse client::post(std::string const& path, httpparams const& params)
+    {
+        return post(path, detail::serialize(params));
+    }
+
+    httpresponse client::get(std::string const& path, bodysink const& sink)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::get(*curl, impl_->base_ + path, sink, impl_->timeout_);
+    }
+
+    httpresponse client::get(std::string const& path, httpparams const& params,
+                             bodysink const& sink)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::get(*curl,
+                           detail::query(impl_->base_ + path, params),
+                           sink,
+                           impl_->timeout_);
+    }
+
+    httpresponse client::post(std::string const& path, std::string const& data,
+                              bodysink const& sink)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::post(*curl,
+                            impl_->base_ + path,
+                            data,
+                            sink,
+                            impl_->timeout_,
+                            impl_->codec());
+    }
+
+    httpresponse client::post(std::string const& path, httpparams const& params,
+                              bodysink const& sink)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::post(*curl,
+                            impl_->base_ + path,
+                            detail::serialize(params),
+                            sink,
+                            impl_->timeout_,
+                            impl_->codec());
+    }
+
+    mappedresponse client::getmapped(std::string const& path, mapoptions const& options)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::getmapped(*curl, impl_->base_ + path, options, impl_->timeout_);
+    }
+
+    httpresponse client::upload(std::string const& path, bodysource const& source,
+                                uploadoptions const& options)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::upload(*curl, impl_->base_ + path, source, options, impl_->timeout_);
+    }
+
+    httpresponse client::uploadfile(std::string const& path, std::string const& localpath,
+                                    uploadoptions const& options)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::uploadfile(*curl, impl_->base_ + path, localpath, options,
+                                  impl_->timeout_);
+    }
+
+    httpresponse client::uploadfd(std::string const& path, int fd,
+                                  uploadoptions const& options)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::uploadfd(*curl, impl_->base_ + path, fd, options, impl_->timeout_);
+    }
+
+    httpresponse client::download(std::string const& path,
+                                  std::string const& localpath)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::download(*curl,
+                                impl_->base_ + path,
+                                localpath,
+                                impl_->timeout_);
+    }
+
+    httpresponse client::resumedownload(std::string const& path,
+                                        std::string const& localpath,
+                                        int                attempts)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::resumedownload(*curl,
+                                      impl_->base_ + path,
+                                      localpath,
+                                      attempts,
+                                      impl_->timeout_);
+    }
+
+    httpresponse client::downloadtarball(std::string const& path,
+                                    std::string const& localpath,
+                                    std::string const& extractdir)
+    {
+        httpresponse result = download(path, localpath);
+        if (result.status == 200)
+            ext::extract_tarball(localpath, extractdir);
+        return result;
+    }
+
+    httpresponse client::downloadtarball(std::string const&     path,
+                                         std::string const&     localpath,
+                                         std::string const&     extractdir,
+                                         tarballoptions const&  options)
+    {
+        impl::lease curl(*impl_, impl_->timeout_);
+        return detail::downloadtarball(*curl,
+                                       impl_->base_ + path,
+                                       localpath,
+                                       extractdir,
+                                       options,
+                                       impl_->timeout_);
+    }
+
+
+    //
+    // engine class implementation
+    //
+    namespace detail
+    {
+        // A request owned by an engine from submission until completion
+        struct job
+        {
+            explicit job(std::string const& url, engine::completion const& done)
+                : curl(url, 0, false), done(done)
+            { }
+
+            pooled_handle curl;
+            transfer t;
+            engine::completion done;
+        };
+
+        // Passes an async GET's response through a cache on its way to the
+        // caller's completion callback
+        struct cache_completion
+        {
+            cache_completion(cached_request const& cached, engine::completion const& done)
+                : cached(cached), done(done)
+            { }
+
+            void operator()(std::exception_ptr error, httpresponse& response) const
+            {
+                if (!error)
+                {
+                    try
+                    {
+                        cached.complete(response);
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+                done(error, response);
+            }
+
+            cached_request cached;
+            engine::completion done;
+        };
+
+        // Hands a response that needed no transfer to a completion callback,
+        // as a task on an engine's thread
+        struct deliver
+        {
+            deliver(httpresponse const& response, engine::completion const& done)
+                : response(response), done(done)
+            { }
+
+            void operator()()
+            {
+                try
+                {
+                    done(std::exception_ptr(), response);
+                }
+                catch (...)
+                {
+                }
+            }
+
+            httpresponse response;
+            engine::completion done;
+        };
+
+        // Adapts a completion callback to fulfil a promise
+        struct fulfil
+        {
+            explicit fulfil(std::shared_ptr<std::promise<httpresponse> > const& p)
+                : promise(p)
+            { }
+
+            void operator()(std::exception_ptr error, httpresponse& response) const
+            {
+                if (error)
+                    promise->set_exception(error);
+                else
+                    promise->set_value(std::move(response));
+            }
+
+            std::shared_ptr<std::promise<httpresponse> > promise;
+        };
+    }
+
+    namespace detail
+    {
+        //
+        // loop
+        //  An engine's workings: a thread driving a multi handle, which jobs
+        //  are queued for from any thread. Engines and clients each own one.
+        //
+        class loop
+        {
+        public:
+            explicit loop(engineoptions const& options)
+                : options_(options), reactor_(multi_), stopping_(false)
+            {
+                bool multiplex = (options.version != engineoptions::http1);
+                multi_.setopt(CURLMOPT_PIPELINING, multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+    #if LIBCURL_VERSION_NUM >= 0x074300
+                multi_.setopt(CURLMOPT_MAX_CONCURRENT_STREAMS, options.maxstreams);
+    #endif
+                if (options.maxperhost > 0)
+                    multi_.setopt(CURLMOPT_MAX_HOST_CONNECTIONS, options.maxperhost);
+                if (options.maxtotal > 0)
+                    multi_.setopt(CURLMOPT_MAX_TOTAL_CONNECTIONS, options.maxtotal);
+
+                thread_ = std::thread(&loop::run, this);
+            }
+
+            ~loop()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stopping_ = true;
+                }
+                reactor_.wakeup();
+                thread_.join();
+            }
+
+            // Takes ownership of a prepared job and hands it to the loop
+            void submit(job* j)
+            {
+                try
+                {
+                    configure(*j->curl);
+                }
+                catch (...)
+                {
+                    return fail(j);
+                }
 
-        httpresponse download(handle&           curl,
-                        std::string const&      url,
-                        std::string const&      localpath,
-                        int                     timeout)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    queue_.push_back(j);
+                }
+                reactor_.wakeup();
+            }
+
+            // Runs a task on the loop's thread, for callbacks that must come
+            // from there even though no transfer was needed
+            void post(std::function<void()> const& task)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    tasks_.push_back(task);
+                }
+                reactor_.wakeup();
+            }
+
+            // Reports a failure to prepare a request through its callback, so
+            // that submission errors look like any other failure
+            static void fail(job* j)
+            {
+                complete(j, std::current_exception());
+            }
+
+        private:
+            void configure(handle& curl)
+            {
+                switch (options_.version)
+                {
+                case engineoptions::http1:
+                    curl.setopt(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+                    break;
+                case engineoptions::http2:
+                    curl.setopt(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+                    break;
+                case engineoptions::http2prior:
+                    curl.setopt(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+                    break;
+                }
+
+                // Queue for a stream on an existing connection rather than
+                // racing to open new ones
+                if (options_.version != engineoptions::http1)
+                    curl.setopt(CURLOPT_PIPEWAIT, 1);
+            }
+
+            void run()
+            {
+                for (;;)
+                {
+                    std::vector<job*> incoming;
+                    std::vector<std::function<void()> > tasks;
+                    bool stopping;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        incoming.swap(queue_);
+                        tasks.swap(tasks_);
+                        stopping = stopping_;
+                        if (stopping && incoming.empty() && tasks.empty() && inflight_.empty())
+                            return;
+                    }
+
+                    for (size_t i = 0; i < tasks.size(); ++i)
+                        tasks[i]();
+
+                    for (size_t i = 0; i < incoming.size(); ++i)
+                    {
+                        job* j = incoming[i];
+                        try
+                        {
+                            (*j->curl).setopt(CURLOPT_PRIVATE, j);
+                            multi_.add(*j->curl);
+                            inflight_.insert(j);
+                        }
+                        catch (...)
+                        {
+                            fail(j);
+                        }
+                    }
+
+                    try
+                    {
+                        if (!inflight_.empty() || !stopping)
+                            reactor_.wait(1000);
+
+                        CURL* easy;
+                        int code;
+                        while (multi_.next(easy, code))
+                        {
+                            job* j = NULL;
+                            curl_easy_getinfo(easy, CURLINFO_PRIVATE, &j);
+                            multi_.remove(easy);
+                            inflight_.erase(j);
+
+                            std::exception_ptr error;
+                            try
+                            {
+                                settle(j->t, code);
+                                finish(*j->curl, j->t);
+                            }
+                            catch (...)
+                            {
+                                error = std::current_exception();
+                            }
+                            complete(j, error);
+                        }
+                    }
+                    catch (...)
+                    {
+                        // The multi handle itself failed, so nothing in flight
+                        // can be trusted to finish
+                        abandon(std::current_exception());
+                    }
+                }
+            }
+
+            // Fails every transfer in flight with the same error
+            void abandon(std::exception_ptr error)
+            {
+                std::set<job*> failed;
+                failed.swap(inflight_);
+                for (std::set<job*>::iterator it = failed.begin(); it != failed.end(); ++it)
+                {
+                    curl_multi_remove_handle(multi_.get(), (*(*it)->curl).get());
+                    complete(*it, error);
+                }
+            }
+
+            static void complete(job* j, std::exception_ptr error)
+            {
+                try
+                {
+                    j->done(error, j->t.result);
+                }
+                catch (...)
+                {
+                }
+                delete j;
+            }
+
+            engineoptions options_;
+            multi multi_;
+            reactor reactor_;
+            std::thread thread_;
+            std::mutex mutex_;
+            std::vector<job*> queue_;
+            std::vector<std::function<void()> > tasks_;
+            bool stopping_;
+            std::set<job*> inflight_;   // Only touched by the loop thread
+        };
+    }
+
+    class engine::impl : public detail::loop
+    {
+    public:
+        explicit impl(engineoptions const& options)
+            : loop(options)
         {
-            httpresponse result;
-            std::ofstream out(localpath.c_str(), std::ios::out |
-                                                 std::ios::binary |
-                                                 std::ios::trunc);
-            // NOTE: download currently doesn't allow compressed responses
-            prepare_basic(curl, result, out, url, timeout, false);
-            curl.perform();
-            curl.getinfo(CURLINFO_RESPONSE_CODE, &result.status);
-            return result;
         }
+    };
+
+    engine::engine(engineoptions const& options)
+        : impl_(new impl(options))
+    {
     }
 
-    namespace ext
+    engine::~engine()
     {
-        void extract_tarball(std::string const& file, std::string const& extractdir)
+    }
+
+    void engine::get(std::string const& url, completion const& done, int timeout)
+    {
+        detail::job* j = new detail::job(url, done);
+        try
         {
-            TAR* t;
+            detail::start_get(*j->curl, j->t, url, timeout);
+        }
+        catch (...)
+        {
+            return impl::fail(j);
+        }
+        impl_->submit(j);
+    }
 
-            // libtar asks for a char*? Bad libtar! Bad! No biscuit.
-            if (tar_open(&t, const_cast<char*>(file.c_str()), NULL, O_RDONLY, 0777, TAR_GNU))
-                throw std::runtime_error("could not open tar");
+    void engine::get(std::string const& url, httpparams const& params,
+                     completion const& done, int timeout)
+    {
+        get(detail::query(url, params), done, timeout);
+    }
 
-            if (tar_extract_all(t, const_cast<char*>(extractdir.c_str())))
-                throw std::runtime_error("could not extract tar");
+    void engine::post(std::string const& url, std::string const& data,
+                      completion const& done, int timeout)
+    {
+        detail::job* j = new detail::job(url, done);
+        try
+        {
+            detail::start_post(*j->curl, j->t, url, data, timeout,
+                               detail::global_compressor());
+        }
+        catch (...)
+        {
+            return impl::fail(j);
+        }
+        impl_->submit(j);
+    }
 
-            tar_close(t);
+    void engine::post(std::string const& url, httpparams const& params,
+                      completion const& done, int timeout)
+    {
+        post(url, detail::serialize(params), done, timeout);
+    }
+
+    void engine::download(std::string const& url, std::string const& localpath,
+                          completion const& done, int timeout)
+    {
+        detail::job* j = new detail::job(url, done);
+        try
+        {
+            detail::start_download(*j->curl, j->t, url, localpath, timeout);
+        }
+        catch (...)
+        {
+            return impl::fail(j);
         }
+        impl_->submit(j);
+    }
+
+    std::future<httpresponse> engine::get(std::string const& url, int timeout)
+    {
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        get(url, detail::fulfil(p), timeout);
+        return p->get_future();
+    }
+
+    std::future<httpresponse> engine::get(std::string const& url,
+                                          httpparams const& params, int timeout)
+    {
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        get(url, params, detail::fulfil(p), timeout);
+        return p->get_future();
+    }
+
+    std::future<httpresponse> engine::post(std::string const& url,
+                                           std::string const& data, int timeout)
+    {
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        post(url, data, detail::fulfil(p), timeout);
+        return p->get_future();
+    }
+
+    std::future<httpresponse> engine::post(std::string const& url,
+                                           httpparams const& params, int timeout)
+    {
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        post(url, params, detail::fulfil(p), timeout);
+        return p->get_future();
+    }
+
+    std::future<httpresponse> engine::download(std::string const& url,
+                                               std::string const& localpath, int timeout)
+    {
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        download(url, localpath, detail::fulfil(p), timeout);
+        return p->get_future();
     }
 
     //
-    // Implementations for the GET/POST free functions
+    // client async functions, which need the engine above
     //
-    httpresponse get(std::string const& url, int timeout)
+    std::shared_ptr<detail::loop> client::impl::async()
     {
-        detail::handle curl;
-        return detail::get(curl, url, timeout);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!engine_)
+            engine_ = std::make_shared<detail::loop>(options_);
+        return engine_;
     }
 
-    httpresponse get(std::string const& url, httpparams const& params, int timeout)
+    void client::impl::submit(detail::job* j)
     {
-        detail::handle curl;
-        return detail::get(curl, detail::query(url, params), timeout);
+        try
+        {
+            // Join the client's session, for its cookies
+            (*j->curl).share(share_.load());
+        }
+        catch (...)
+        {
+            return detail::loop::fail(j);
+        }
+        async()->submit(j);
     }
 
-    httpresponse post(std::string const& url, std::string const& data, int timeout)
+    void client::getasync(std::string const& path, completion const& done)
     {
-        detail::handle curl;
-        return detail::post(curl, url, data, timeout);
+        std::string url = impl_->base_ + path;
+        detail::cached_request cached(impl_->cache_.load(), url);
+        httpresponse hit;
+        if (cached.fresh(hit))
+            return impl_->async()->post(detail::deliver(hit, done));
+
+        detail::job* j = new detail::job(url, detail::cache_completion(cached, done));
+        try
+        {
+            detail::start_get(*j->curl, j->t, url, impl_->timeout_);
+            cached.condition(*j->curl);
+        }
+        catch (...)
+        {
+            return detail::loop::fail(j);
+        }
+        impl_->submit(j);
     }
 
-    httpresponse post(std::string const& url, httpparams const& params, int timeout)
+    void client::postasync(std::string const& path, std::string const& data,
+                           completion const& done)
     {
-        detail::handle curl;
-        return detail::post(curl, url, detail::serialize(params), timeout);
+        std::string url = impl_->base_ + path;
+        detail::job* j = new detail::job(url, done);
+        try
+        {
+            detail::start_post(*j->curl, j->t, url, data, impl_->timeout_, impl_->codec());
+        }
+        catch (...)
+        {
+            return detail::loop::fail(j);
+        }
+        impl_->submit(j);
     }
 
-    httpresponse download(std::string const& url, std::string const& localpath, int timeout)
+    std::future<httpresponse> client::getasync(std::string const& path)
     {
-        detail::handle curl;
-        return detail::download(curl, url, localpath, timeout);
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        getasync(path, detail::fulfil(p));
+        return p->get_future();
     }
 
-    httpresponse downloadtarball(std::string const& url,
-                                 std::string const& localpath,
-                                 std::string const& extractdir,
-                                 int                timeout)
+    std::future<httpresponse> client::getasync(std::string const& path,
+                                               httpparams const& params)
     {
-        httpresponse result = download(url, localpath, timeout);
-        if (result.status == 200)
-            ext::extract_tarball(localpath, extractdir);
-        return result;
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        getasync(path + "?" + detail::serialize(params), detail::fulfil(p));
+        return p->get_future();
+    }
+
+    std::future<httpresponse> client::postasync(std::string const& path,
+                                                std::string const& data)
+    {
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        postasync(path, data, detail::fulfil(p));
+        return p->get_future();
     }
 
+    std::future<httpresponse> client::postasync(std::string const& path,
+                                                httpparams const& params)
+    {
+        std::shared_ptr<std::promise<httpresponse> > p(new std::promise<httpresponse>());
+        postasync(path, detail::serialize(params), detail::fulfil(p));
+        return p->get_future();
+    }
 
     //
-    // client class implementation
+    // batches
     //
-    class client::impl
+    namespace detail
     {
-    public:
-        impl(std::string const& baseurl, int timeout)
-            : base_(baseurl), timeout_(timeout)
+        // Results of a batch, and the window of requests in flight
+        struct batch
         {
-        }
+            batch(size_t size, batchoptions const& options)
+                : results(size), each(options.each),
+                  limit(std::max<size_t>(options.concurrency, 1)), inflight(0)
+            { }
 
-        detail::handle handle_;
-        std::string base_;
-        int timeout_;
-    };
+            std::vector<batchresult> results;
+            batchcallback each;
+            size_t limit;
+            size_t inflight;
+            std::mutex mutex;
+            std::condition_variable vacancy;
+        };
 
-    client::client(std::string const& baseurl, int timeout)
-        : impl_(new impl(baseurl, timeout))
+        // Completion callback for one request of a batch
+        struct batchslot
+        {
+            batchslot(batch* b, size_t index)
+                : b(b), index(index)
+            { }
+
+            void operator()(std::exception_ptr error, httpresponse& response) const
+            {
+                batchresult& r = b->results[index];
+                r.error = error;
+                if (!error)
+                    r.response = std::move(response);
+
+                if (b->each)
+                {
+                    try
+                    {
+                        b->each(index, r);
+                    }
+                    catch (...)
+                    {
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(b->mutex);
+                --b->inflight;
+                b->vacancy.notify_one();
+            }
+
+            batch* b;
+            size_t index;
+        };
+    }
+
+    httpresponse& batchresult::get()
     {
+        if (error)
+            std::rethrow_exception(error);
+        return response;
     }
 
-    client::~client()
+    std::vector<batchresult> getall(std::vector<request> const& requests,
+                                    batchoptions const& options)
     {
-        // This destructor is empty but vital! Without it, auto_ptr cannot
-        // generate a call to impl's destructor. For an interesting look
-        // at this and other PIMPL issues, see Herb Sutter's GOTW #100.
-        // (http://herbsutter.com/gotw/_100)
+        detail::batch b(requests.size(), options);
+        {
+            // Destroying the engine waits for the last requests
+            engine e(options.connections);
+            for (size_t i = 0; i < requests.size(); ++i)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(b.mutex);
+                    while (b.inflight >= b.limit)
+                        b.vacancy.wait(lock);
+                    ++b.inflight;
+                }
+
+                request const& r = requests[i];
+                detail::batchslot slot(&b, i);
+                if (r.method == "GET")
+                    e.get(r.url, slot, r.timeout);
+                else if (r.method == "POST")
+                    e.post(r.url, r.data, slot, r.timeout);
+                else
+                {
+                    httpresponse none;
+                    slot(std::make_exception_ptr(std::invalid_argument(
+                        "unsupported batch request method: " + r.method)), none);
+                }
+            }
+        }
+        return std::move(b.results);
     }
 
-    std::string client::base() const
+#if defined(__cpp_impl_coroutine)
+    //
+    // Coroutine support
+    //  An awaitable's state is shared with the completion callback, which
+    //  may run on the engine thread while, or even before, the coroutine
+    //  suspends. Whichever of the two comes second resumes it: the
+    //  callback, by resuming the suspended coroutine, or await_suspend, by
+    //  declining to suspend.
+    //
+    namespace detail
     {
-        return impl_->base_;
+        static std::shared_ptr<executor> global_executor;
+
+        // The engine behind the async_ functions, started on first use
+        engine& shared_engine()
+        {
+            static engine e;
+            return e;
+        }
+
+        struct resumer
+        {
+            explicit resumer(std::coroutine_handle<> waiting)
+                : waiting(waiting)
+            { }
+
+            void operator()() const
+            {
+                waiting.resume();
+            }
+
+            std::coroutine_handle<> waiting;
+        };
+
+        struct await_get
+        {
+            void operator()(completion const& done) const
+            {
+                shared_engine().get(url, done, timeout);
+            }
+
+            std::string url;
+            int timeout;
+        };
+
+        struct await_post
+        {
+            void operator()(completion const& done) const
+            {
+                shared_engine().post(url, data, done, timeout);
+            }
+
+            std::string url;
+            std::string data;
+            int timeout;
+        };
+
+        struct await_download
+        {
+            void operator()(completion const& done) const
+            {
+                shared_engine().download(url, localpath, done, timeout);
+            }
+
+            std::string url;
+            std::string localpath;
+            int timeout;
+        };
     }
 
-    std::string client::cookie() const
+    struct awaitable::state
     {
-        curl_slist* list = NULL;
-        impl_->handle_.getinfo(CURLINFO_COOKIELIST, &list);
-        std::ostringstream result;
-        while(list)
+        enum { pending, completed, suspended };
+
+        state()
+            : phase(pending)
+        { }
+
+        // Completion callback that hands the outcome to the awaitable
+        struct finish
+        {
+            explicit finish(std::shared_ptr<state> const& s)
+                : s(s)
+            { }
+
+            void operator()(std::exception_ptr error, httpresponse& response) const
+            {
+                s->error = error;
+                if (!error)
+                    s->response = std::move(response);
+                if (s->phase.exchange(completed) == suspended)
+                    s->resume();
+            }
+
+            std::shared_ptr<state> s;
+        };
+
+        void resume()
         {
-            result << list->data << "\n";
-            list = list->next;
+            if (exec)
+                exec(detail::resumer(waiting));
+            else
+                waiting.resume();
         }
-        curl_slist_free_all(list);
-        return result.str();
+
+        starter start;
+        executor exec;
+        std::coroutine_handle<> waiting;
+        std::exception_ptr error;
+        httpresponse response;
+        std::atomic<int> phase;
+    };
+
+    void setexecutor(executor const& e)
+    {
+        std::shared_ptr<executor> p;
+        if (e)
+            p.reset(new executor(e));
+        std::atomic_store(&detail::global_executor, p);
     }
 
-    void client::setcookie(std::string const& data)
+    awaitable::awaitable(starter const& start)
+        : state_(new state)
     {
-        impl_->handle_.setopt(CURLOPT_COOKIELIST, "ALL");
-        std::istringstream ss(data);
-        std::string line;
-        while (!ss.eof())
+        state_->start = start;
+    }
+
+    awaitable& awaitable::via(executor const& e)
+    {
+        state_->exec = e;
+        return *this;
+    }
+
+    bool awaitable::await_suspend(std::coroutine_handle<> waiting)
+    {
+        state_->waiting = waiting;
+        if (!state_->exec)
         {
-            std::getline(ss, line);
-            impl_->handle_.setopt(CURLOPT_COOKIELIST, line.c_str());
+            std::shared_ptr<executor> global = std::atomic_load(&detail::global_executor);
+            if (global)
+                state_->exec = *global;
         }
+
+        state_->start(state::finish(state_));
+        return state_->phase.exchange(state::suspended) != state::completed;
     }
 
-    httpresponse client::get(std::string const& path)
+    httpresponse awaitable::await_resume()
     {
-        return detail::get(impl_->handle_, impl_->base_ + path, impl_->timeout_);
+        if (state_->error)
+            std::rethrow_exception(state_->error);
+        return std::move(state_->response);
     }
 
-    httpresponse client::get(std::string const& path, httpparams const& params)
+    awaitable async_get(std::string const& url, int timeout)
     {
-        return detail::get(impl_->handle_,
-                           detail::query(impl_->base_ + path, params), impl_->timeout_);
+        detail::await_get start = { url, timeout };
+        return awaitable(start);
     }
 
-    httpresponse client::post(std::string const& path, std::string const& data)
+    awaitable async_get(std::string const& url, httpparams const& params, int timeout)
     {
-        return detail::post(impl_->handle_,
-                            impl_->base_ + path,
-                            data,
-                            impl_->timeout_);
+        return async_get(detail::query(url, params), timeout);
     }
 
-    httpresponse client::post(std::string const& path, httpparams const& params)
+    awaitable async_post(std::string const& url, std::string const& data, int timeout)
     {
-        return detail::post(impl_->handle_,
-                            impl_->base_ + path,
-                            detail::serialize(params),
-                            impl_->timeout_);
+        detail::await_post start = { url, data, timeout };
+        return awaitable(start);
     }
 
-    httpresponse client::download(std::string const& path,
-                                  std::string const& localpath)
+    awaitable async_post(std::string const& url, httpparams const& params, int timeout)
     {
-        return detail::download(impl_->handle_,
-                                impl_->base_ + path,
-                                localpath,
-                                impl_->timeout_);
+        return async_post(url, detail::serialize(params), timeout);
     }
 
-    httpresponse client::downloadtarball(std::string const& path,
-                                    std::string const& localpath,
-                                    std::string const& extractdir)
+    awaitable async_download(std::string const& url, std::string const& localpath,
+                             int timeout)
     {
-        httpresponse result = download(path, localpath);
-        if (result.status == 200)
-            ext::extract_tarball(localpath, extractdir);
-        return result;
+        detail::await_download start = { url, localpath, timeout };
+        return awaitable(start);
     }
+#endif
 }
-